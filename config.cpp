@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
@@ -156,6 +157,8 @@ bool Config::ReadConfig(std::istream &in, const char *path) {
     std::make_tuple("json",             cfg_json(json_,errstr)),
     std::make_tuple("jobs",             cfg_numeric(max_jobs_)),
     std::make_tuple("file_lists",       cfg_bool(package_filelist_)),
+    std::make_tuple("trace_links",      cfg_bool(trace_links_)),
+    std::make_tuple("compression_level", cfg_numeric(compression_level_)),
   };
 
   size_t lineno = 0;
@@ -228,10 +231,7 @@ enum {
     WHITE = GRAY
 };
 
-void Config::Log(uint level, const char *msg, ...) const {
-  if (level < log_level_)
-    return;
-
+void Config::Log_do(uint level, const char *msg, ...) const {
   FILE *out = (level <= Message) ? stdout : stderr;
 
   if (level == Message) {
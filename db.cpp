@@ -3,35 +3,28 @@
 #include <utility>
 
 #include "main.h"
-
-#ifdef PKGDEPDB_ENABLE_THREADS
-#  include <atomic>
-#  include <thread>
-#  include <future>
-#  include <unistd.h>
-#endif
-
-#ifdef PKGDEPDB_WITH_ALPM
-#  include <alpm.h>
-#endif
-
 #include "pkgdepdb.h"
 #include "elf.h"
 #include "package.h"
 #include "db.h"
 #include "filter.h"
+#include "threads.h"
+#include "vercmp.h"
 
 namespace pkgdepdb {
 
 string strref::empty("");
 
 DB::DB(const Config& optconfig)
-: config_(optconfig) {
+: config_ (optconfig),
+  strings_(new StringPool) {
   loaded_version_           = DB::CURRENT;
   contains_package_depends_ = false;
   contains_groups_          = false;
   contains_filelists_       = false;
+  filelists_failed_         = false;
   strict_linking_           = false;
+  search_paths_valid_       = false;
 }
 
 DB::~DB() {
@@ -51,24 +44,49 @@ DB::DB(bool wiped, const DB &copy)
   ignore_file_rules_   (copy.ignore_file_rules_),
   package_library_path_(copy.package_library_path_),
   base_packages_       (copy.base_packages_),
-  config_              (copy.config_)
+  config_              (copy.config_),
+  strings_             (copy.strings_)
 {
-  loaded_version_ = copy.loaded_version_;
-  strict_linking_ = copy.strict_linking_;
+  loaded_version_     = copy.loaded_version_;
+  strict_linking_     = copy.strict_linking_;
+  search_paths_valid_ = false;
   if (!wiped) {
     stdreplace(packages_, copy.packages_);
     stdreplace(objects_,  copy.objects_);
+    RebuildIndices();
   }
 }
 
-PackageList::const_iterator DB::FindPkg_i(const string& name) const {
-  return std::find_if(packages_.begin(), packages_.end(),
-    [&name](const Package *pkg) { return pkg->name_ == name; });
+PkgIndex::const_iterator DB::FindPkg_i(const string& name) const {
+  // package names live in our string pool, unknown strings are no names
+  istring key = strings_->Find(name);
+  if (!key.length() && name.length())
+    return package_index_.end();
+  return package_index_.find(key);
+}
+
+// An exact, non-negated name filter only lets the packages of that name
+// through, so it is answered by the index rather than checking every
+// package. Older databases can hold several packages of one name while the
+// index only has the first of them, then every package is checked.
+DB::PackageRange DB::FilterCandidates(const FilterList &filters) const {
+  if (package_index_.size() != packages_.size())
+    return { packages_.data(), packages_.data() + packages_.size() };
+  for (auto &filter : filters) {
+    const string *name = filter->exact_name();
+    if (!name)
+      continue;
+    auto entry = FindPkg_i(*name);
+    if (entry == package_index_.end())
+      return { nullptr, nullptr };
+    return { &entry->second, &entry->second + 1 };
+  }
+  return { packages_.data(), packages_.data() + packages_.size() };
 }
 
 Package* DB::FindPkg(const string& name) const {
-  auto pkg = FindPkg_i(name);
-  return (pkg != packages_.end()) ? *pkg : nullptr;
+  auto entry = FindPkg_i(name);
+  return (entry != package_index_.end()) ? entry->second : nullptr;
 }
 
 bool DB::WipePackages() {
@@ -76,11 +94,20 @@ bool DB::WipePackages() {
     return false;
   objects_.clear();
   packages_.clear();
+  filelists_source_.reset();
+  filelists_failed_ = false;
+  package_index_.clear();
+  provide_index_.clear();
+  replace_index_.clear();
+  soname_index_.clear();
+  missing_index_.clear();
   return true;
 }
 
 bool DB::WipeFilelists() {
   bool hadfiles = contains_filelists_;
+  filelists_source_.reset();
+  filelists_failed_ = false;
   for (auto &pkg : packages_) {
     if (!pkg->filelist_.empty()) {
       pkg->filelist_.clear();
@@ -105,15 +132,170 @@ const StringList* DB::GetPackageLibPath(const Package *pkg) const {
   return nullptr;
 }
 
+uint32_t DB::DirID(const string& dir) {
+  auto id = dir_ids_.emplace(dir, uint32_t(dir_ids_.size()));
+  return id.first->second;
+}
+
+void DB::AddPathList(vec<uint32_t> &out, const string& list) {
+  size_t at = 0;
+  size_t to = list.find_first_of(':', 0);
+  while (to != string::npos) {
+    out.push_back(DirID(list.substr(at, to-at)));
+    at = to+1;
+    to = list.find_first_of(':', at);
+  }
+  out.push_back(DirID(list.substr(at)));
+}
+
+void DB::CompileSearchPath(Elf *obj) {
+  auto &path = obj->search_path_;
+  path.clear();
+
+  // DT_RPATH first
+  if (obj->info_->rpath_set_)
+    AddPathList(path, obj->info_->rpath_);
+
+  // LD_LIBRARY_PATH - ignored
+
+  // DT_RUNPATH
+  if (obj->info_->runpath_set_)
+    AddPathList(path, obj->info_->runpath_);
+
+  // Trusted Paths
+  path.push_back(DirID("/lib"));
+  path.push_back(DirID("/usr/lib"));
+
+  for (auto &dir : library_path_)
+    path.push_back(DirID(dir));
+
+  if (const StringList *extrapaths = GetObjectLibPath(obj)) {
+    for (auto &dir : *extrapaths)
+      path.push_back(DirID(dir));
+  }
+
+  // only membership matters, the order is given by objects_
+  std::sort(path.begin(), path.end());
+  path.erase(std::unique(path.begin(), path.end()), path.end());
+}
+
+void DB::UpdateSearchPaths() {
+  if (search_paths_valid_)
+    return;
+  for (auto &obj : objects_)
+    CompileSearchPath(obj);
+  search_paths_valid_ = true;
+}
+
+void DB::IndexObject(Elf *obj) {
+  soname_index_[obj->basename_].push_back(obj);
+  obj->dir_id_ = DirID(obj->dirname_);
+  CompileSearchPath(obj);
+}
+
+void DB::UnindexObject(const Elf *obj) {
+  auto iter = soname_index_.find(obj->basename_);
+  if (iter == soname_index_.end())
+    return;
+  auto &list = iter->second;
+  list.erase(std::remove(list.begin(), list.end(), obj), list.end());
+  if (list.empty())
+    soname_index_.erase(iter);
+}
+
+void DB::IndexProvides(const Package *pkg) {
+  for (auto &prov : pkg->provides_)
+    provide_index_[prov.name_].push_back(pkg);
+  for (auto &repl : pkg->replaces_)
+    replace_index_[repl.name_].push_back(pkg);
+}
+
+void DB::UnindexProvides(const Package *pkg) {
+  auto unindex = [pkg](PkgListMap &index, const DependList &names) {
+    for (auto &dep : names) {
+      auto iter = index.find(dep.name_);
+      if (iter == index.end())
+        continue;
+      auto &list = iter->second;
+      list.erase(std::remove(list.begin(), list.end(), pkg), list.end());
+      if (list.empty())
+        index.erase(iter);
+    }
+  };
+  unindex(provide_index_, pkg->provides_);
+  unindex(replace_index_, pkg->replaces_);
+}
+
+void DB::RebuildIndices() {
+  // the first package of a name is the one which is found
+  package_index_.clear();
+  for (auto &pkg : packages_)
+    package_index_.emplace(pkg->name_, pkg);
+  provide_index_.clear();
+  replace_index_.clear();
+  for (auto &pkg : packages_)
+    IndexProvides(pkg);
+  soname_index_.clear();
+  for (auto &obj : objects_)
+    IndexObject(obj);
+  search_paths_valid_ = true;
+  RebuildLinks();
+}
+
+void DB::RebuildLinks() {
+  missing_index_.clear();
+  for (auto &obj : objects_)
+    obj->found_by_.clear();
+  for (auto &obj : objects_) {
+    for (Elf *found : obj->req_found_)
+      found->found_by_.insert(obj);
+    for (auto &missing : obj->req_missing_)
+      missing_index_[missing].insert(obj);
+  }
+}
+
+void DB::UnlinkObject(Elf *obj) {
+  for (Elf *found : obj->req_found_)
+    found->found_by_.erase(obj);
+  obj->req_found_.clear();
+  for (auto &missing : obj->req_missing_) {
+    auto iter = missing_index_.find(missing);
+    if (iter == missing_index_.end())
+      continue;
+    iter->second.erase(obj);
+    if (iter->second.empty())
+      missing_index_.erase(iter);
+  }
+  obj->req_missing_.clear();
+}
+
+void DB::AddMissing(Elf *obj, istring name) {
+  if (obj->req_missing_.insert(name).second)
+    missing_index_[name].insert(obj);
+}
+
 bool DB::DeletePackage(const string& name)
 {
+  UpdateSearchPaths();
+
   const Package *old; {
-    auto pkgiter = FindPkg_i(name);
-    if (pkgiter == packages_.end())
+    auto entry = FindPkg_i(name);
+    if (entry == package_index_.end())
       return true;
 
-    old = *pkgiter;
-    packages_.erase(packages_.begin() + (pkgiter - packages_.begin()));
+    old = entry->second;
+    package_index_.erase(entry);
+    auto next = packages_.erase(std::find(packages_.begin(), packages_.end(),
+                                          old));
+    // older databases can have another package of the same name
+    next = std::find_if(next, packages_.end(), [old](const Package *pkg) {
+      return pkg->name_ == old->name_;
+    });
+    if (next != packages_.end())
+      package_index_.emplace(old->name_, *next);
+    UnindexProvides(old);
+    // a stored file list which was not loaded is not needed anymore
+    DropFilelist(old);
   }
 
   for (auto &elfsp : old->objects_) {
@@ -121,87 +303,47 @@ bool DB::DeletePackage(const string& name)
     // remove the object from the list
     objects_.erase(std::remove(objects_.begin(), objects_.end(), elf),
                    objects_.end());
+    UnindexObject(elf);
+    UnlinkObject(elf);
   }
 
-  for (auto &seeker : objects_) {
-    for (auto &elfsp : old->objects_) {
-      Elf *elf = elfsp.get();
-      // for each object which depends on this object,
-      // search for a replacing object
-      auto ref = std::find(seeker->req_found_.begin(),
-                           seeker->req_found_.end(),
-                           elf);
-      if (ref == seeker->req_found_.end())
-        continue;
-      seeker->req_found_.erase(ref);
+  for (auto &elfsp : old->objects_) {
+    Elf *elf = elfsp.get();
+    // for each object which depends on this object,
+    // search for a replacing object
+    for (Elf *seeker : elf->found_by_) {
+      seeker->req_found_.erase(elf);
 
-      const StringList *libpaths = GetObjectLibPath(seeker);
-      if (Elf *other = FindFor (seeker, elf->basename_, libpaths))
+      if (Elf *other = FindFor (seeker, elf->basename_)) {
         seeker->req_found_.insert(other);
+        other->found_by_.insert(seeker);
+      }
       else
-        seeker->req_missing_.insert(elf->basename_);
+        AddMissing(seeker, elf->basename_);
     }
+    elf->found_by_.clear();
   }
 
   delete old;
 
   objects_.erase(
     std::remove_if(objects_.begin(), objects_.end(),
-      [](rptr<Elf> &obj) { return 1 == obj->refcount_; }),
+      [this](rptr<Elf> &obj) {
+        if (1 != obj->refcount_)
+          return false;
+        UnindexObject(obj);
+        UnlinkObject(obj);
+        return true;
+      }),
     objects_.end());
 
   return true;
 }
 
-static bool pathlist_contains(const string& list, const string& path) {
-  size_t at = 0;
-  size_t to = list.find_first_of(':', 0);
-  while (to != string::npos) {
-    if (list.compare(at, to-at, path) == 0)
-      return true;
-    at = to+1;
-    to = list.find_first_of(':', at);
-  }
-  if (list.compare(at, string::npos, path) == 0)
-    return true;
-  return false;
-}
-
-bool DB::ElfFinds(const Elf *elf, const string& path,
-                  const StringList *extrapaths) const
-{
-  // DT_RPATH first
-  if (elf->rpath_set_ && pathlist_contains(elf->rpath_, path))
-    return true;
-
-  // LD_LIBRARY_PATH - ignored
-
-  // DT_RUNPATH
-  if (elf->runpath_set_ && pathlist_contains(elf->runpath_, path))
-    return true;
-
-  // Trusted Paths
-  if (path == "/lib" ||
-      path == "/usr/lib")
-  {
-    return true;
-  }
-
-  if (std::find(library_path_.begin(), library_path_.end(), path)
-      != library_path_.end())
-  {
-    return true;
-  }
-
-  if (extrapaths) {
-    if (std::find(extrapaths->begin(), extrapaths->end(), path)
-        != extrapaths->end())
-    {
-      return true;
-    }
-  }
-
-  return false;
+bool DB::ElfFinds(const Elf *elf, const Elf *lib) const {
+  return std::binary_search(elf->search_path_.begin(),
+                            elf->search_path_.end(),
+                            lib->dir_id_);
 }
 
 bool DB::InstallPackage(Package* &&pkg) {
@@ -209,6 +351,8 @@ bool DB::InstallPackage(Package* &&pkg) {
     return false;
 
   packages_.push_back(pkg);
+  package_index_.emplace(pkg->name_, pkg);
+  IndexProvides(pkg);
   if (pkg->depends_.size()    ||
       pkg->optdepends_.size() ||
       pkg->replaces_.size()   ||
@@ -222,202 +366,192 @@ bool DB::InstallPackage(Package* &&pkg) {
   if (pkg->filelist_.size())
     contains_filelists_ = true;
 
-  const StringList *libpaths = GetPackageLibPath(pkg);
-
-  for (auto &obj : pkg->objects_)
+  for (auto &obj : pkg->objects_) {
+    obj->owner_ = pkg;
     objects_.push_back(obj);
+    IndexObject(obj);
+  }
   // loop anew since we need to also be able to found our own packages
-  for (auto &obj : pkg->objects_)
-    LinkObject_do(obj, pkg);
+  LinkPackage_do(pkg);
 
   // check for packages which are looking for any of our packages
-  for (auto &seeker : objects_) {
-    for (auto &obj : pkg->objects_) {
-      if (!seeker->CanUse(*obj, strict_linking_) ||
-          !ElfFinds(seeker, obj->dirname_, libpaths))
+  for (auto &obj : pkg->objects_) {
+    auto waiting = missing_index_.find(obj->basename_);
+    if (waiting == missing_index_.end())
+      continue;
+    auto &seekers = waiting->second;
+    for (auto seeker = seekers.begin(); seeker != seekers.end(); ) {
+      if (!(*seeker)->CanUse(*obj, strict_linking_) ||
+          !ElfFinds(*seeker, obj))
       {
+        ++seeker;
         continue;
       }
 
-      if (0 != seeker->req_missing_.erase(obj->basename_))
-        seeker->req_found_.insert(obj);
+      (*seeker)->req_missing_.erase(obj->basename_);
+      (*seeker)->req_found_.insert(obj);
+      obj->found_by_.insert(*seeker);
+      seeker = seekers.erase(seeker);
     }
+    if (seekers.empty())
+      missing_index_.erase(waiting);
   }
   return true;
 }
 
-Elf* DB::FindFor(const Elf *obj, const string& needed,
-                 const StringList *extrapath) const
-{
-  config_.Log(Debug, "dependency of %s/%s   :  %s\n",
-              obj->dirname_.c_str(), obj->basename_.c_str(), needed.c_str());
-  for (auto &lib : objects_) {
+// resolution tracing is enabled by --trace-links, not by the log level,
+// so it works in builds without debug messages
+Elf* DB::FindFor(const Elf *obj, istring needed) const {
+  bool trace = config_.trace_links_;
+  if (trace)
+    config_.Log(Print, "dependency of %s/%s   :  %s\n",
+                obj->dirname_.c_str(), obj->basename_.c_str(),
+                needed.c_str());
+  auto candidates = soname_index_.find(needed);
+  if (candidates == soname_index_.end()) {
+    if (trace)
+      config_.Log(Print, "  not found\n");
+    return 0;
+  }
+  // the candidates are in objects_ order, so the first match stays the same
+  for (Elf *lib : candidates->second) {
     if (!obj->CanUse(*lib, strict_linking_)) {
-      config_.Log(Debug, "  skipping %s/%s (objclass)\n",
-                  lib->dirname_.c_str(), lib->basename_.c_str());
-      continue;
-    }
-    if (lib->basename_    != needed) {
-      config_.Log(Debug, "  skipping %s/%s (wrong name)\n",
-                  lib->dirname_.c_str(), lib->basename_.c_str());
+      if (trace)
+        config_.Log(Print, "  skipping %s/%s (objclass)\n",
+                    lib->dirname_.c_str(), lib->basename_.c_str());
       continue;
     }
-    if (!ElfFinds(obj, lib->dirname_, extrapath)) {
-      config_.Log(Debug, "  skipping %s/%s (not visible)\n",
-                  lib->dirname_.c_str(), lib->basename_.c_str());
+    if (!ElfFinds(obj, lib)) {
+      if (trace)
+        config_.Log(Print, "  skipping %s/%s (not visible)\n",
+                    lib->dirname_.c_str(), lib->basename_.c_str());
       continue;
     }
     // same class, same name, and visible...
+    if (trace)
+      config_.Log(Print, "  found %s/%s\n",
+                  lib->dirname_.c_str(), lib->basename_.c_str());
     return lib;
   }
+  if (trace)
+    config_.Log(Print, "  not found\n");
   return 0;
 }
 
-void DB::LinkObject_do(Elf *obj, const Package *owner) {
-  obj->req_found_.clear();
-  obj->req_missing_.clear();
-  LinkObject(obj, owner, obj->req_found_, obj->req_missing_);
+void DB::LinkObject_do(Elf *obj) {
+  UnlinkObject(obj);
+  vec<Elf*> req_found;
+  LinkObject(obj, req_found, obj->req_missing_);
+  for (Elf *found : req_found) {
+    obj->req_found_.insert(found);
+    found->found_by_.insert(obj);
+  }
+  for (auto &missing : obj->req_missing_)
+    missing_index_[missing].insert(obj);
 }
 
-void DB::LinkObject(Elf *obj, const Package *owner,
-                    ObjectSet &req_found, StringSet &req_missing) const
-{
-  if (ignore_file_rules_.size()) {
-    string full = obj->dirname_ + "/" + obj->basename_;
-    if (ignore_file_rules_.find(full) != ignore_file_rules_.end())
-      return;
+bool DB::IsIgnored(const Elf *obj) const {
+  if (!ignore_file_rules_.size())
+    return false;
+  string full = obj->dirname_ + "/" + obj->basename_;
+  return ignore_file_rules_.find(full) != ignore_file_rules_.end();
+}
+
+// takes over the links of another path to the same file
+void DB::LinkAlias_do(Elf *obj, const Elf *linked) {
+  UnlinkObject(obj);
+  obj->req_found_   = linked->req_found_;
+  obj->req_missing_ = linked->req_missing_;
+  for (Elf *found : obj->req_found_)
+    found->found_by_.insert(obj);
+  for (auto &missing : obj->req_missing_)
+    missing_index_[missing].insert(obj);
+}
+
+// Symlinks to a file share its info and search the same paths, so the
+// dependencies are only looked up once per file. Paths with an ignore rule
+// are linked on their own.
+void DB::LinkPackage_do(Package *pkg) {
+  std::unordered_map<const ElfInfo*, const Elf*> linked;
+  for (Elf *obj : pkg->objects_) {
+    if (IsIgnored(obj)) {
+      LinkObject_do(obj);
+      continue;
+    }
+    auto done = linked.find(obj->info_.get());
+    if (done != linked.end()) {
+      LinkAlias_do(obj, done->second);
+      continue;
+    }
+    LinkObject_do(obj);
+    linked[obj->info_.get()] = obj;
   }
+}
 
-  const StringList *libpaths = GetPackageLibPath(owner);
+// Only reads the database, and the results are plain pointers (no rptr
+// reference counting), so this can run on several threads at once.
+void DB::LinkObject(const Elf *obj, vec<Elf*> &req_found,
+                    IStringSet &req_missing) const
+{
+  if (IsIgnored(obj))
+    return;
 
-  for (auto &needed : obj->needed_) {
-    Elf *found = FindFor (obj, needed, libpaths);
+  for (auto &needed : obj->info_->needed_) {
+    Elf *found = FindFor (obj, needed);
     if (found)
-      req_found.insert(found);
+      req_found.push_back(found);
     else if (assume_found_rules_.find(needed) == assume_found_rules_.end())
       req_missing.insert(needed);
   }
 }
 
 #ifdef PKGDEPDB_ENABLE_THREADS
-namespace thread {
-
-  static unsigned int ncpus_init() {
-    long v = sysconf(_SC_NPROCESSORS_CONF);
-    return (v <= 0 ? 1 : (unsigned int)v);
-  }
-
-  static unsigned int ncpus = ncpus_init();
-
-  using status_printer_func_t =
-    void (unsigned long at, unsigned long count, unsigned long threads);
-
-  template<typename PerThread>
-  using worker_func_t =
-    void(std::atomic_ulong*, size_t from, size_t to, PerThread&);
-
-  template<typename PerThread>
-  using merger_func_t = void(vec<PerThread>&&);
-
-  template<typename PerThread>
-  void work(unsigned long                      Count,
-            function<status_printer_func_t>    StatusPrinter,
-            function<worker_func_t<PerThread>> Worker,
-            function<merger_func_t<PerThread>> Merger,
-            const Config&                      Config)
-  {
-    unsigned long threadcount = thread::ncpus;
-    if (Config.max_jobs_ >= 1 && Config.max_jobs_ < threadcount)
-      threadcount = Config.max_jobs_;
-
-    unsigned long  obj_per_thread = Count / threadcount;
-    if (!Config.quiet_)
-      StatusPrinter(0, Count, threadcount);
-
-    if (threadcount == 1) {
-      for (unsigned long i = 0; i != Count; ++i) {
-        PerThread Data;
-        Worker(nullptr, i, i+1, Data);
-        if (!Config.quiet_)
-          StatusPrinter(i, Count, 1);
-      }
-      return;
-    }
-
-    // data created by threads, to be merged in the merger
-    vec<PerThread> Data;
-    Data.resize(threadcount);
-
-    std::atomic_ulong         counter(0);
-    vec<std::thread*> threads;
-
-    unsigned long i;
-    for (i = 0; i != threadcount-1; ++i) {
-      threads.emplace_back(
-        new std::thread(Worker,
-                        &counter,
-                        i*obj_per_thread,
-                        i*obj_per_thread + obj_per_thread,
-                        std::ref(Data[i])));
-    }
-    threads.emplace_back(
-      new std::thread(Worker,
-                      &counter,
-                      i*obj_per_thread, Count,
-                      std::ref(Data[i])));
-    if (!Config.quiet_) {
-      unsigned long c = 0;
-      while (c != Count) {
-        c = counter.load();
-        StatusPrinter(c, Count, threadcount);
-        usleep(100000);
-      }
-    }
-
-    for (i = 0; i != threadcount; ++i) {
-      threads[i]->join();
-      delete threads[i];
-    }
-    Merger(move(Data));
-    if (!Config.quiet_)
-      StatusPrinter(Count, Count, threadcount);
-  }
-
-} // namespace thread
-
 void DB::RelinkAll_Threaded() {
-  //using FoundMap   = std::map<Elf*, ObjectSet>;
-  //using MissingMap = std::map<Elf*, StringSet>;
-  //using Tuple      = std::tuple<FoundMap, MissingMap>;
-  auto worker = [this](std::atomic_ulong *count, size_t from, size_t to, int&)
+  // the threads only collect results, which are applied in the merger
+  struct Result {
+    Elf        *obj;
+    vec<Elf*>   req_found;
+    IStringSet  req_missing;
+  };
+  using ResultList = vec<Result>;
+
+  auto worker = [this](std::atomic_ulong *count, size_t from, size_t to,
+                       ResultList &results)
   {
-    //FoundMap   *f = &std::get<0>(tup);
-    //MissingMap *m = &std::get<1>(tup);
     for (size_t i = from; i != to; ++i) {
       const Package *pkg = this->packages_[i];
 
-      for (auto &obj : pkg->objects_) {
-        this->LinkObject_do(obj, pkg);
-        //ObjectSet req_found;
-        //StringSet req_missing;
-        //this->LinkObject(obj, pkg, req_found, req_missing);
-        //(*f)[obj] = move(req_found);
-        //(*m)[obj] = move(req_missing);
+      // see LinkPackage_do
+      std::unordered_map<const ElfInfo*, size_t> linked;
+      for (Elf *obj : pkg->objects_) {
+        bool ignored = this->IsIgnored(obj);
+        auto done = ignored ? linked.end() : linked.find(obj->info_.get());
+        if (done != linked.end()) {
+          Result alias { obj, results[done->second].req_found,
+                              results[done->second].req_missing };
+          results.push_back(move(alias));
+          continue;
+        }
+        if (!ignored)
+          linked[obj->info_.get()] = results.size();
+        results.push_back({ obj, {}, {} });
+        Result &res(results.back());
+        this->LinkObject(obj, res.req_found, res.req_missing);
       }
 
       if (count && !config_.quiet_)
         (*count)++;
     }
   };
-  auto merger = [this](vec<int> &&) {
-    //for (auto &t : tup) {
-    //  FoundMap   &found = std::get<0>(t);
-    //  MissingMap &missing = std::get<1>(t);
-    //  for (auto &f : found)
-    //    f.first->req_found = move(f.second);
-    //  for (auto &m : missing)
-    //    m.first->req_missing = move(m.second);
-    //}
+  auto merger = [](vec<ResultList> &&all) {
+    // every object has exactly one result, so the order does not matter
+    for (auto &results : all) {
+      for (auto &res : results) {
+        res.obj->req_found_ = ObjectSet(res.req_found.begin(),
+                                        res.req_found.end());
+        res.obj->req_missing_ = move(res.req_missing);
+      }
+    }
   };
   double fac = 100.0 / double(packages_.size());
   unsigned int pc = 1000;
@@ -434,7 +568,10 @@ void DB::RelinkAll_Threaded() {
     if (at == cnt)
       printf("\n");
   };
-  thread::work<int>(packages_.size(), status, worker, merger, config_);
+  auto weight = [this](size_t i) { return packages_[i]->objects_.size(); };
+  thread::work<ResultList>(packages_.size(), status, worker, merger, config_,
+                           weight);
+  RebuildLinks();
 }
 #endif
 
@@ -442,14 +579,12 @@ void DB::RelinkAll() {
   if (!packages_.size())
     return;
 
+  UpdateSearchPaths();
+
 #ifdef PKGDEPDB_ENABLE_THREADS
-  if (config_.max_jobs_ != 1   &&
-      thread::ncpus     >  1   &&
-      packages_.size()  >  100 &&
-      objects_.size()   >= 300)
-  {
+  // traced lookups are printed as they happen and must not interleave
+  if (thread::threadcount(config_) > 1 && !config_.trace_links_)
     return RelinkAll_Threaded();
-  }
 #endif
 
   unsigned long pkgcount = packages_.size();
@@ -461,9 +596,7 @@ void DB::RelinkAll() {
     fflush(stdout);
   }
   for (auto &pkg : packages_) {
-    for (auto &obj : pkg->objects_) {
-      LinkObject_do(obj, pkg);
-    }
+    LinkPackage_do(pkg);
     if (!config_.quiet_) {
       ++count;
       auto newpc = (unsigned int)(fac * double(count));
@@ -483,9 +616,13 @@ void DB::RelinkAll() {
 
 void DB::FixPaths() {
   for (auto &obj : objects_) {
-    fixpathlist(obj->rpath_);
-    fixpathlist(obj->runpath_);
+    string rpath(obj->info_->rpath_), runpath(obj->info_->runpath_);
+    fixpathlist(rpath);
+    fixpathlist(runpath);
+    obj->info_->rpath_   = strings_->Get(move(rpath));
+    obj->info_->runpath_ = strings_->Get(move(runpath));
   }
+  search_paths_valid_ = false;
 }
 
 bool DB::Empty() const {
@@ -496,6 +633,7 @@ bool DB::Empty() const {
 bool DB::LD_Clear() {
   if (library_path_.size()) {
     library_path_.clear();
+    search_paths_valid_ = false;
     return true;
   }
   return false;
@@ -519,6 +657,7 @@ bool DB::LD_Delete(size_t i) {
   if (!library_path_.size() || i >= library_path_.size())
     return false;
   library_path_.erase(library_path_.begin() + i);
+  search_paths_valid_ = false;
   return true;
 }
 
@@ -533,6 +672,7 @@ bool DB::LD_Delete(const string& dir_) {
   auto old = std::find(library_path_.begin(), library_path_.end(), dir);
   if (old != library_path_.end()) {
     library_path_.erase(old);
+    search_paths_valid_ = false;
     return true;
   }
   return false;
@@ -547,6 +687,7 @@ bool DB::LD_Insert(const string& dir_, size_t i) {
   auto old = std::find(library_path_.begin(), library_path_.end(), dir);
   if (old == library_path_.end()) {
     library_path_.insert(library_path_.begin() + i, dir);
+    search_paths_valid_ = false;
     return true;
   }
   size_t oldidx = old - library_path_.begin();
@@ -555,6 +696,7 @@ bool DB::LD_Insert(const string& dir_, size_t i) {
   // exists
   library_path_.erase(old);
   library_path_.insert(library_path_.begin() + i, dir);
+  search_paths_valid_ = false;
   return true;
 }
 
@@ -572,6 +714,7 @@ bool DB::PKG_LD_Insert(const string& package,
   auto old = std::find(path.begin(), path.end(), dir);
   if (old == path.end()) {
     path.insert(path.begin() + i, dir);
+    search_paths_valid_ = false;
     return true;
   }
   size_t oldidx = old - path.begin();
@@ -580,6 +723,7 @@ bool DB::PKG_LD_Insert(const string& package,
   // exists
   path.erase(old);
   path.insert(path.begin() + i, dir);
+  search_paths_valid_ = false;
   return true;
 }
 
@@ -596,6 +740,7 @@ bool DB::PKG_LD_Delete(const string& package, const string& directory) {
     path.erase(old);
     if (!path.size())
       package_library_path_.erase(iter);
+    search_paths_valid_ = false;
     return true;
   }
   return false;
@@ -612,6 +757,7 @@ bool DB::PKG_LD_Delete(const string& package, size_t i) {
   path.erase(path.begin()+i);
   if (!path.size())
     package_library_path_.erase(iter);
+  search_paths_valid_ = false;
   return true;
 }
 
@@ -621,6 +767,7 @@ bool DB::PKG_LD_Clear(const string& package) {
     return false;
 
   package_library_path_.erase(iter);
+  search_paths_valid_ = false;
   return true;
 }
 
@@ -758,7 +905,7 @@ void DB::ShowPackages(bool                 filter_broken,
 
   if (!config_.quiet_)
     printf("Packages:%s\n", (filter_broken ? " (filter: 'broken')" : ""));
-  for (auto &pkg : packages_) {
+  for (auto &pkg : FilterCandidates(pkg_filters)) {
     if (!util::all(pkg_filters, *this, *pkg))
       continue;
     if (filter_broken && !IsBroken(pkg))
@@ -839,12 +986,12 @@ void DB::ShowObjects(const FilterList    &pkg_filters,
            (unsigned)obj->ei_class_, obj->classString(),
            (unsigned)obj->ei_data_,  obj->dataString(),
            (unsigned)obj->ei_osabi_, obj->osabiString());
-    if (obj->rpath_set_)
-      printf("     rpath: %s\n", obj->rpath_.c_str());
-    if (obj->runpath_set_)
-      printf("     runpath: %s\n", obj->runpath_.c_str());
-    if (obj->interpreter_.length())
-      printf("     interpreter: %s\n", obj->interpreter_.c_str());
+    if (obj->info_->rpath_set_)
+      printf("     rpath: %s\n", obj->info_->rpath_.c_str());
+    if (obj->info_->runpath_set_)
+      printf("     runpath: %s\n", obj->info_->runpath_.c_str());
+    if (obj->info_->interpreter_.length())
+      printf("     interpreter: %s\n", obj->info_->interpreter_.c_str());
     if (config_.verbosity_ < 2)
       continue;
     printf("     finds:\n"); {
@@ -899,10 +1046,12 @@ void DB::ShowFound() {
 void DB::ShowFilelist(const FilterList    &pkg_filters,
                       const StrFilterList &str_filters)
 {
+  if (!LoadFilelists())
+    return;
   if (config_.json_ & JSONBits::Query)
     return ShowFilelist_json(pkg_filters, str_filters);
 
-  for (auto &pkg : packages_) {
+  for (auto &pkg : FilterCandidates(pkg_filters)) {
     if (!util::all(pkg_filters, *this, *pkg))
       continue;
     for (auto &file : pkg->filelist_) {
@@ -915,289 +1064,447 @@ void DB::ShowFilelist(const FilterList    &pkg_filters,
   }
 }
 
-static void strip_version(string &s) {
-  size_t from = s.find_first_of("=<>!");
-  if (from != string::npos)
-    s.erase(from);
-}
-
-#ifdef PKGDEPDB_WITH_ALPM
-bool split_depstring(const string &full,
-                     string       &name,
-                     string       &op,
-                     string       &ver)
+static bool version_op(Dependency::Op      op,
+                       istring             v1,
+                       istring             v2,
+                       const VercmpCache  &vercmp)
 {
-  size_t opidx = full.find_first_of("=<>!");
-  if (opidx != string::npos) {
-    name = full.substr(0, opidx);
-
-    op.append(1, full[opidx++]);
-    if (opidx >= full.length())
-      return false;
-
-    if (full[opidx] == '=') {
-      op.append(1, '=');
-      ++opidx;
-    }
-    if (opidx >= full.length())
-      return false;
-    ver = full.substr(opidx);
+  int res = vercmp(v1, v2);
+  switch (op) {
+    case Dependency::EQ: return res == 0;
+    case Dependency::NE: return res != 0;
+    case Dependency::GT: return res >  0;
+    case Dependency::GE: return res >= 0;
+    case Dependency::LT: return res <  0;
+    case Dependency::LE: return res <= 0;
+    default:             return false;
   }
-  else
-    name = full;
-  return true;
 }
 
-static bool version_op(const string &op, const char *v1, const char *v2) {
-  int res = alpm_pkg_vercmp(v1, v2);
-  if ( (op == "="  && res == 0) ||
-       (op == "!=" && res != 0) ||
-       (op == ">"  && res >  0) ||
-       (op == ">=" && res >= 0) ||
-       (op == "<"  && res <  0) ||
-       (op == "<=" && res <= 0) )
-  {
-    return true;
-  }
-  return false;
-}
-
-static bool version_satisfies(const string &dop,
-                              const string &dver,
-                              const string &pop,
-                              const string &pver)
+static bool version_satisfies(Dependency::Op      dop,
+                              istring             dver,
+                              Dependency::Op      pop,
+                              istring             pver,
+                              const VercmpCache  &vercmp)
 {
+  using D = Dependency;
   // does the provided version pver satisfy the required version hver?
-  int ret = alpm_pkg_vercmp(dver.c_str(), pver.c_str());
+  int ret = vercmp(dver, pver);
   if (dop == pop) {
     // want exact version, provided exact version
-    if (dop == "=")  return ret == 0;
+    if (dop == D::EQ) return ret == 0;
     // don't want some exact version (very odd case)
-    if (dop == "!=") return ret != 0;
+    if (dop == D::NE) return ret != 0;
     // depending on >= A, so the provided must be >= A
-    if (dop == ">=") return ret <  0;
+    if (dop == D::GE) return ret <  0;
     // and so on
-    if (dop == ">")  return ret <= 0;
-    if (dop == "<=") return ret >  0;
-    if (dop == "<")  return ret >= 0;
+    if (dop == D::GT) return ret <= 0;
+    if (dop == D::LE) return ret >  0;
+    if (dop == D::LT) return ret >= 0;
     return false;
   }
   // depending on a specific version
-  if (dop == "=")
+  if (dop == D::EQ)
     return false;
   // depending on something not being a specific version:
-  if (dop == "!=") {
-    if (pop == "=")  return ret != 0;
-    if (pop == ">")  return ret >  0;
-    if (pop == ">=") return ret >= 0;
-    if (pop == "<")  return ret <  0;
-    if (pop == "<=") return ret <= 0;
+  if (dop == D::NE) {
+    if (pop == D::EQ) return ret != 0;
+    if (pop == D::GT) return ret >  0;
+    if (pop == D::GE) return ret >= 0;
+    if (pop == D::LT) return ret <  0;
+    if (pop == D::LE) return ret <= 0;
     return false;
   }
   // rest
-  if (dop == ">=") {
-    if (pop == "=")  return ret < 0;
-    if (pop == ">")  return ret < 0;
-    if (pop == ">=") return ret < 0;
+  if (dop == D::GE) {
+    if (pop == D::EQ) return ret < 0;
+    if (pop == D::GT) return ret < 0;
+    if (pop == D::GE) return ret < 0;
     return false;
   }
-  if (dop == ">") {
-    if (pop == "=")  return ret <= 0;
-    if (pop == ">")  return ret <= 0;
-    if (pop == ">=") return ret <= 0;
+  if (dop == D::GT) {
+    if (pop == D::EQ) return ret <= 0;
+    if (pop == D::GT) return ret <= 0;
+    if (pop == D::GE) return ret <= 0;
     return false;
   }
-  if (dop == "<=") {
-    if (pop == "=")  return ret >  0;
-    if (pop == "<")  return ret >  0;
-    if (pop == "<=") return ret >  0;
+  if (dop == D::LE) {
+    if (pop == D::EQ) return ret >  0;
+    if (pop == D::LT) return ret >  0;
+    if (pop == D::LE) return ret >  0;
     return false;
   }
-  if (dop == "<") {
-    if (pop == "=")  return ret >= 0;
-    if (pop == "<")  return ret >= 0;
-    if (pop == "<=") return ret >= 0;
+  if (dop == D::LT) {
+    if (pop == D::EQ) return ret >= 0;
+    if (pop == D::LT) return ret >= 0;
+    if (pop == D::LE) return ret >= 0;
     return false;
   }
   return false;
 }
 
 bool package_satisfies(const Package     *other,
-                       const string &dep,
-                       const string &op,
-                       const string &ver)
+                       const Dependency  &dep,
+                       const VercmpCache &vercmp)
 {
-  if (version_op(op, other->version_.c_str(), ver.c_str()))
+  if (version_op(dep.op_, other->version_, dep.version_, vercmp))
     return true;
-  for (auto &p : other->provides_) {
-    string prov, pop, pver;
-    split_depstring(p, prov, pop, pver);
-    if (prov != dep)
+  for (auto &prov : other->provides_) {
+    if (prov.name_ != dep.name_)
       continue;
-    if (version_satisfies(op, ver, pop, pver))
+    if (version_satisfies(dep.op_, dep.version_, prov.op_, prov.version_,
+                          vercmp))
+    {
       return true;
+    }
   }
   return false;
 }
-#endif
 
-static const Package* find_depend(const string     &dependency,
-                                  const PkgMap     &pkgmap,
-                                  const PkgListMap &providemap,
-                                  const PkgListMap &replacemap)
+static const Package* find_depend(const Dependency  &dep,
+                                  const PkgMap      &pkgmap,
+                                  const PkgListMap  &providemap,
+                                  const PkgListMap  &replacemap,
+                                  const VercmpCache &vercmp)
 {
-  if (!dependency.length())
+  if (dep.full_.empty())
     return 0;
 
-#ifdef PKGDEPDB_WITH_ALPM
-  string dep, op, ver;
-  split_depstring(dependency, dep, op, ver);
-#else
-  string dep(dependency);
-  strip_version(dep);
-#endif
-
-  auto find = pkgmap.find(dep);
+  auto find = pkgmap.find(dep.name_);
   if (find != pkgmap.end()) {
-#ifdef PKGDEPDB_WITH_ALPM
     const Package *other = find->second;
-    if (!ver.length() || package_satisfies(other, dep, op, ver))
-#endif
+    if (dep.version_.empty() || package_satisfies(other, dep, vercmp))
       return find->second;
   }
   // check for a providing package
-  auto rep = replacemap.find(dep);
+  auto rep = replacemap.find(dep.name_);
   if (rep != replacemap.end()) {
-#ifdef PKGDEPDB_WITH_ALPM
-    if (!ver.length())
+    if (dep.version_.empty())
       return rep->second[0];
     for (auto other : rep->second) {
-      if (package_satisfies(other, dep, op, ver))
+      if (package_satisfies(other, dep, vercmp))
         return other;
     }
-#else
-    return rep->second[0];
-#endif
   }
 
-  rep = providemap.find(dep);
+  rep = providemap.find(dep.name_);
   if (rep != providemap.end()) {
-#ifdef PKGDEPDB_WITH_ALPM
-    if (!ver.length())
+    if (dep.version_.empty())
       return rep->second[0];
 
     for (auto other : rep->second) {
-      if (package_satisfies(other, dep, op, ver))
+      if (package_satisfies(other, dep, vercmp))
         return other;
     }
-#else
-    return rep->second[0];
-#endif
   }
   return nullptr;
 }
 
-static void install_recursive(vec<const Package*>         &packages,
-                              PkgMap                      &installmap,
-                              const Package               *pkg,
-                              const PkgMap                &pkgmap,
-                              const PkgListMap            &providemap,
-                              const PkgListMap            &replacemap,
-                              const bool                   showmsg,
-                              const bool                   quiet)
-{
-  if (installmap.find(pkg->name_) != installmap.end())
-    return;
-  installmap[pkg->name_] = pkg;
+// a set of packages by their index in the package list
+using PkgBits = vec<uint64_t>;
+
+// the names a package occupies once it is installed
+static IStringList installed_names(const Package *pkg) {
+  IStringList names { pkg->name_ };
+  for (auto &prov : pkg->provides_)
+    names.push_back(prov.name_);
+  for (auto &repl : pkg->replaces_)
+    names.push_back(repl.name_);
+  return names;
+}
+
+static inline void bits_set(PkgBits &bits, size_t i) {
+  bits[i/64] |= uint64_t(1) << (i%64);
+}
+
+static inline bool bits_test(const PkgBits &bits, size_t i) {
+  return bits[i/64] & (uint64_t(1) << (i%64));
+}
 
-  for (auto prov : pkg->provides_) {
-    strip_version(prov);
-    installmap[prov] = pkg;
+static inline void bits_or(PkgBits &bits, const PkgBits &other) {
+  for (size_t i = 0; i != bits.size(); ++i)
+    bits[i] |= other[i];
+}
+
+// The dependency graph of the integrity check, with package indices as
+// nodes. Every package of a strongly connected component pulls in the same
+// set of packages, so the closure is computed once per component.
+struct DepGraph {
+  DepGraph(const PackageList &packages,
+           const PkgMap      &pkgmap,
+           const PkgListMap  &providemap,
+           const PkgListMap  &replacemap,
+           const PkgMap      &basemap,
+           const VercmpCache &vercmp);
+
+  // the packages pulled in by installing a package on top of the base
+  PkgBits Pulled(size_t id) const;
+
+  const PkgMap                               &basemap_;
+  const VercmpCache                          &vercmp_;
+  std::unordered_map<const Package*, size_t>  index_;
+  vec<vec<size_t>>                            edges_;
+  // base packages are never expanded
+  vec<bool>                                   sink_;
+  // ids of the names each package installs, its own name first
+  vec<vec<size_t>>                            names_;
+  size_t                                      name_count_;
+  // other packages installing the name of a package
+  vec<vec<size_t>>                            shadowers_;
+  PkgBits                                     base_;
+  vec<size_t>                                 component_;
+  vec<PkgBits>                                closure_;
+  // components whose closure depends on the order of the walk
+  vec<bool>                                   ordered_;
+};
+
+DepGraph::DepGraph(const PackageList &packages,
+                   const PkgMap      &pkgmap,
+                   const PkgListMap  &providemap,
+                   const PkgListMap  &replacemap,
+                   const PkgMap      &basemap,
+                   const VercmpCache &vercmp)
+  : basemap_(basemap)
+  , vercmp_ (vercmp)
+{
+  static const size_t npos = size_t(-1);
+  const size_t count = packages.size();
+  const size_t words = (count + 63) / 64;
+
+  for (size_t i = 0; i != count; ++i)
+    index_[packages[i]] = i;
+
+  base_.assign(words, 0);
+  for (auto &b : basemap)
+    bits_set(base_, index_[b.second]);
+
+  sink_.assign(count, false);
+  edges_.resize(count);
+  names_.resize(count);
+  std::unordered_map<istring, size_t> name_ids;
+  for (size_t i = 0; i != count; ++i) {
+    const Package *pkg = packages[i];
+    if (basemap.find(pkg->name_) != basemap.end()) {
+      sink_[i] = true;
+      continue;
+    }
+    for (auto &dep : pkg->depends_) {
+      if (auto found = find_depend(dep, pkgmap, providemap, replacemap,
+                                   vercmp))
+        edges_[i].push_back(index_[found]);
+    }
+    for (auto &dep : pkg->optdepends_) {
+      if (auto found = find_depend(dep, pkgmap, providemap, replacemap,
+                                   vercmp))
+        edges_[i].push_back(index_[found]);
+    }
+    for (auto &name : installed_names(pkg)) {
+      auto id = name_ids.emplace(name, name_ids.size());
+      names_[i].push_back(id.first->second);
+    }
   }
-  for (auto repl : pkg->replaces_) {
-    strip_version(repl);
-    installmap[repl] = pkg;
+  name_count_ = name_ids.size();
+
+  vec<vec<size_t>> installers(name_count_);
+  for (size_t i = 0; i != count; ++i) {
+    for (size_t name : names_[i])
+      installers[name].push_back(i);
   }
-#ifdef PKGDEPDB_WITH_ALPM
-  for (auto &full : pkg->conflicts_) {
-    string conf, op, ver;
-    if (!split_depstring(full, conf, op, ver))
-      break;
 
-    auto found = installmap.find(conf);
-    const Package *other = found->second;
-    if (found == installmap.end() || other == pkg)
+  // A package is skipped when an installed package already provides its
+  // name. When that happens within a closure, it matters which of them is
+  // reached first, so such components are walked per package instead.
+  vec<size_t> shadowed;
+  shadowers_.resize(count);
+  for (size_t i = 0; i != count; ++i) {
+    if (sink_[i])
       continue;
-    // found a conflict
-    if (op.length() && ver.length()) {
-      // version related conflict
-      // pkg conflicts with {other} <op> {ver}
-      if (!version_op(op, other->version_.c_str(), ver.c_str()))
+    for (size_t other : installers[names_[i][0]]) {
+      if (other != i)
+        shadowers_[i].push_back(other);
+    }
+    if (!shadowers_[i].empty())
+      shadowed.push_back(i);
+  }
+
+  // Tarjan's algorithm with an explicit stack. Components are completed in
+  // reverse topological order, so the closures of everything a component
+  // depends on are known by the time it is completed.
+  vec<size_t> order(count, npos), low(count);
+  vec<bool>   onstack(count, false);
+  vec<size_t> stack;
+  vec<std::pair<size_t, size_t>> calls;
+  size_t counter = 0;
+
+  component_.assign(count, npos);
+  auto enter = [&](size_t v) {
+    order[v] = low[v] = counter++;
+    stack.push_back(v);
+    onstack[v] = true;
+    calls.emplace_back(v, 0);
+  };
+  for (size_t root = 0; root != count; ++root) {
+    if (order[root] != npos)
+      continue;
+    enter(root);
+    while (!calls.empty()) {
+      size_t v = calls.back().first;
+      if (calls.back().second != edges_[v].size()) {
+        size_t w = edges_[v][calls.back().second++];
+        if (order[w] == npos)
+          enter(w);
+        else if (onstack[w])
+          low[v] = std::min(low[v], order[w]);
+        continue;
+      }
+      calls.pop_back();
+      if (!calls.empty()) {
+        size_t u = calls.back().first;
+        low[u] = std::min(low[u], low[v]);
+      }
+      if (low[v] != order[v])
         continue;
+
+      const size_t id = closure_.size();
+      closure_.emplace_back(words, 0);
+      PkgBits &closure = closure_.back();
+      size_t member;
+      vec<size_t> members;
+      do {
+        member = stack.back();
+        stack.pop_back();
+        onstack[member] = false;
+        component_[member] = id;
+        members.push_back(member);
+      } while (member != v);
+      for (size_t m : members) {
+        if (sink_[m])
+          continue;
+        bits_set(closure, m);
+        for (size_t w : edges_[m]) {
+          if (component_[w] != id)
+            bits_or(closure, closure_[component_[w]]);
+        }
+      }
+
+      bool ordered = false;
+      for (size_t s : shadowed) {
+        if (!bits_test(closure, s))
+          continue;
+        for (size_t other : shadowers_[s]) {
+          if ((ordered = bits_test(closure, other)))
+            break;
+        }
+        if (ordered)
+          break;
+      }
+      ordered_.push_back(ordered);
     }
-    if (showmsg) {
+  }
+}
+
+PkgBits DepGraph::Pulled(size_t id) const {
+  PkgBits bits(base_);
+  if (sink_[id])
+    return bits;
+
+  const size_t comp = component_[id];
+  if (!ordered_[comp]) {
+    bits_or(bits, closure_[comp]);
+    return bits;
+  }
+
+  // install depth first in dependency order like pacman would
+  vec<bool> installed(name_count_, false);
+  vec<std::pair<size_t, size_t>> stack;
+  auto install = [&](size_t at) {
+    if (sink_[at] || installed[names_[at][0]])
+      return;
+    for (size_t name : names_[at])
+      installed[name] = true;
+    bits_set(bits, at);
+    stack.emplace_back(at, 0);
+  };
+  install(id);
+  while (!stack.empty()) {
+    auto &top = stack.back();
+    if (top.second == edges_[top.first].size())
+      stack.pop_back();
+    else
+      install(edges_[top.first][top.second++]);
+  }
+  return bits;
+}
+
+void DB::CheckIntegrity(const Package       *pkg,
+                        const DepGraph      &graph,
+                        const PkgMap        &pkgmap,
+                        const PkgListMap    &providemap,
+                        const PkgListMap    &replacemap,
+                        const ObjListMap    &objmap,
+                        const ObjFilterList &obj_filters) const
+{
+  const size_t id = graph.index_.find(pkg)->second;
+  const bool   quiet = config_.quiet_;
+
+  // base packages are considered installed already
+  if (!graph.sink_[id]) {
+    IStringList names(installed_names(pkg));
+    for (auto &conf : pkg->conflicts_) {
+      // an operator without a version
+      if (conf.op_ != Dependency::ANY && conf.version_.empty())
+        break;
+
+      auto found = graph.basemap_.find(conf.name_);
+      if (found == graph.basemap_.end() ||
+          std::find(names.begin(), names.end(), conf.name_) != names.end())
+      {
+        continue;
+      }
+      const Package *other = found->second;
+      // found a conflict
+      if (conf.op_ != Dependency::ANY) {
+        // version related conflict
+        // pkg conflicts with {other} <op> {ver}
+        if (!version_op(conf.op_, other->version_, conf.version_,
+                        graph.vercmp_))
+        {
+          continue;
+        }
+      }
       printf("%s%s conflicts with %s (%s-%s): { %s }\n",
              (quiet ? "" : "\r"),
              pkg->name_.c_str(),
-             conf.c_str(),
+             conf.name_.c_str(),
              other->name_.c_str(),
              other->version_.c_str(),
-             full.c_str());
+             conf.c_str());
     }
-  }
-#endif
-  packages.push_back(pkg);
-  for (auto &dep : pkg->depends_) {
-    auto found = find_depend(dep, pkgmap, providemap, replacemap);
-    if (!found) {
-      if (showmsg) {
+    for (auto &dep : pkg->depends_) {
+      if (!find_depend(dep, pkgmap, providemap, replacemap, graph.vercmp_)) {
         printf("%smissing package: %s depends on %s\n",
                (quiet ? "" : "\r"),
                pkg->name_.c_str(),
                dep.c_str());
       }
-      continue;
     }
-    install_recursive(packages, installmap, found,
-                      pkgmap, providemap, replacemap, false, quiet);
-  }
-  for (auto &dep : pkg->optdepends_) {
-    auto found = find_depend(dep, pkgmap, providemap, replacemap);
-    if (!found) {
-      if (showmsg) {
+    for (auto &dep : pkg->optdepends_) {
+      if (!find_depend(dep, pkgmap, providemap, replacemap, graph.vercmp_)) {
         printf("%smissing package: %s depends optionally on %s\n",
                (quiet ? "" : "\r"),
                pkg->name_.c_str(),
                dep.c_str());
       }
-      continue;
     }
-    install_recursive(packages, installmap, found,
-                      pkgmap, providemap, replacemap, false, quiet);
   }
-}
 
-void DB::CheckIntegrity(const Package             *pkg,
-                        const PkgMap              &pkgmap,
-                        const PkgListMap          &providemap,
-                        const PkgListMap          &replacemap,
-                        const PkgMap              &basemap,
-                        const ObjListMap          &objmap,
-                        const vec<const Package*> &package_base,
-                        const ObjFilterList       &obj_filters) const
-{
-  vec<const Package*> pulled(package_base);
-  PkgMap              installmap(basemap);
-
-  install_recursive(pulled, installmap, pkg,
-                    pkgmap, providemap, replacemap, true, config_.quiet_);
-  (void)objmap;
+  PkgBits pulled(graph.Pulled(id));
 
   StringSet needed;
   for (auto &obj : pkg->objects_) {
     if (!util::all(obj_filters, *this, *obj))
       continue;
-    for (auto &need : obj->needed_) {
+    for (auto &need : obj->info_->needed_) {
       auto fnd = objmap.find(need);
       if (fnd == objmap.end()) {
         needed.insert(need);
@@ -1205,8 +1512,8 @@ void DB::CheckIntegrity(const Package             *pkg,
       }
       bool found = false;
       for (auto &o : fnd->second) {
-        if (std::find(pulled.begin(), pulled.end(), o->owner_) != pulled.end())
-        {
+        auto owner = graph.index_.find(o->owner_);
+        if (owner != graph.index_.end() && bits_test(pulled, owner->second)) {
           found = true;
           break;
         }
@@ -1214,7 +1521,7 @@ void DB::CheckIntegrity(const Package             *pkg,
       if (!found) {
         if (config_.verbosity_ > 0)
           printf("%s%s: %s not pulled in for %s/%s\n",
-                 (config_.quiet_ ? "" : "\r"),
+                 (quiet ? "" : "\r"),
                  pkg->name_.c_str(),
                  need.c_str(),
                  obj->dirname_.c_str(), obj->basename_.c_str());
@@ -1224,14 +1531,14 @@ void DB::CheckIntegrity(const Package             *pkg,
   }
   for (auto &n : needed) {
     printf("%s%s: doesn't pull in %s\n",
-           (config_.quiet_ ? "" : "\r"),
+           (quiet ? "" : "\r"),
            pkg->name_.c_str(),
            n.c_str());
   }
 }
 
 void DB::CheckIntegrity(const FilterList    &pkg_filters,
-                        const ObjFilterList &obj_filters) const
+                        const ObjFilterList &obj_filters)
 {
   config_.Log(Message, "Looking for stale object files...\n");
   for (auto &o : objects_) {
@@ -1242,28 +1549,13 @@ void DB::CheckIntegrity(const FilterList    &pkg_filters,
   }
 
   config_.Log(Message, "Preparing data to check package dependencies...\n");
-  // we assume here that std::map has better search performance than O(n)
   PkgMap     pkgmap;
-  PkgListMap providemap, replacemap;
   ObjListMap objmap;
+  const PkgListMap &providemap(provide_index_),
+                   &replacemap(replace_index_);
 
-  for (auto &p: packages_) {
+  for (auto &p: packages_)
     pkgmap[p->name_] = p;
-    auto addit = [](const Package *pkg, string /*copy*/ name,
-                    PkgListMap &map)
-    {
-      strip_version(name);
-      auto fnd = map.find(name);
-      if (fnd == map.end())
-        map.emplace(name, move(vec<const Package*>({pkg})));
-      else
-        fnd->second.push_back(pkg);
-    };
-    for (auto prov : p->provides_)
-      addit(p, prov, providemap);
-    for (auto repl : p->replaces_)
-      addit(p, repl, replacemap);
-  }
 
   for (auto &o: objects_) {
     if (o->owner_)
@@ -1271,17 +1563,16 @@ void DB::CheckIntegrity(const FilterList    &pkg_filters,
   }
 
   // install base system:
-  vec<const Package*> base;
-  PkgMap              basemap;
-
+  PkgMap basemap;
   for (auto &basepkg : base_packages_) {
-    auto p = pkgmap.find(basepkg);
-    if (p != pkgmap.end()) {
-      base.push_back(p->second);
-      basemap[basepkg] = p->second;
-    }
+    auto p = pkgmap.find(strings_->Find(basepkg));
+    if (p != pkgmap.end())
+      basemap[p->first] = p->second;
   }
 
+  VercmpCache vercmp;
+  DepGraph graph(packages_, pkgmap, providemap, replacemap, basemap, vercmp);
+
   // print some stats
   config_.Log(Message,
       "packages: %lu, provides: %lu, replacements: %lu, objects: %lu\n",
@@ -1311,14 +1602,14 @@ void DB::CheckIntegrity(const FilterList    &pkg_filters,
 
   config_.Log(Message, "Checking package dependencies...\n");
 #ifdef PKGDEPDB_ENABLE_THREADS
-  if (config_.max_jobs_ == 1) {
+  if (thread::threadcount(config_) <= 1) {
 #endif
     status(0, packages_.size(), 1);
     for (size_t i = 0; i != packages_.size(); ++i) {
       if (!util::all(pkg_filters, *this, *packages_[i]))
         continue;
-      CheckIntegrity(packages_[i], pkgmap, providemap, replacemap,
-                      basemap, objmap, base, obj_filters);
+      CheckIntegrity(packages_[i], graph, pkgmap, providemap, replacemap,
+                     objmap, obj_filters);
       if (!config_.quiet_)
         status(i, packages_.size(), 1);
     }
@@ -1328,60 +1619,175 @@ void DB::CheckIntegrity(const FilterList    &pkg_filters,
       (void)n;
     };
     auto worker =
-      [this,&pkgmap,&providemap,&replacemap,
-       &objmap,&base,&basemap,&obj_filters,&pkg_filters]
+      [this,&graph,&pkgmap,&providemap,&replacemap,
+       &objmap,&obj_filters,&pkg_filters]
     (std::atomic_ulong *count, size_t from, size_t to, int &dummy) {
       (void)dummy;
 
       for (size_t i = from; i != to; ++i) {
         const Package *pkg = packages_[i];
         if (util::all(pkg_filters, *this, *pkg)) {
-          CheckIntegrity(pkg, pkgmap, providemap, replacemap,
-                          basemap, objmap, base, obj_filters);
+          CheckIntegrity(pkg, graph, pkgmap, providemap, replacemap,
+                         objmap, obj_filters);
         }
         if (count)
           ++*count;
       }
     };
-    thread::work<int>(packages_.size(), status, worker, merger, config_);
+    auto weight = [this](size_t i) { return packages_[i]->objects_.size(); };
+    thread::work<int>(packages_.size(), status, worker, merger, config_,
+                      weight);
   }
 #endif
 
   config_.Log(Message, "Checking for file conflicts...\n");
-  std::map<strref,vec<const Package*>> file_counter;
-  for (auto &pkg : packages_) {
-    for (auto &file : pkg->filelist_) {
-      file_counter[file].push_back(pkg);
+  if (LoadFilelists())
+    CheckFileConflicts(vercmp);
+}
+
+// Files are grouped by a hash of their path. The hash partitions the
+// files between the threads, and within a partition it is compared before
+// the paths are.
+struct FileEntry {
+  uint32_t      hash;
+  uint32_t      pkg;
+  const string *path;
+
+  bool operator<(const FileEntry &o) const {
+    if (hash != o.hash)
+      return hash < o.hash;
+    int cmp = path->compare(*o.path);
+    if (cmp)
+      return cmp < 0;
+    return pkg < o.pkg;
+  }
+};
+
+struct FileConflict {
+  const string        *path;
+  vec<const Package*>  packages;
+};
+
+static void collect_files(const PackageList    &packages,
+                          size_t                from,
+                          size_t                to,
+                          vec<vec<FileEntry>>  &parts)
+{
+  std::hash<string> hasher;
+  for (size_t i = from; i != to; ++i) {
+    for (auto &file : packages[i]->filelist_) {
+      auto hash = uint32_t(hasher(file));
+      parts[hash % parts.size()].push_back({ hash, uint32_t(i), &file });
     }
   }
-  for (auto &file : file_counter) {
-    auto &pkgs = std::get<1>(file);
-    if (pkgs.size() < 2)
+}
+
+static void find_file_conflicts(vec<FileEntry>      &files,
+                                const PackageList   &packages,
+                                const VercmpCache   &vercmp,
+                                vec<FileConflict>   &out)
+{
+  std::sort(files.begin(), files.end());
+  for (size_t i = 0; i != files.size();) {
+    size_t end = i + 1;
+    while (end != files.size() && files[end].hash == files[i].hash &&
+           *files[end].path == *files[i].path)
+    {
+      ++end;
+    }
+    if (end - i < 2) {
+      i = end;
       continue;
+    }
 
-    vec<const Package*> realpkgs;
+    FileConflict found { files[i].path, {} };
     // Do not consider two conflicting packages which contain
     // the same files to be file-conflicting.
-    for (auto &a : pkgs) {
+    for (size_t a = i; a != end; ++a) {
+      const Package *pkg = packages[files[a].pkg];
       bool conflict = false;
-      for (auto &b : pkgs) {
-        if (&a == &b) continue;
-        if ( (conflict = a->ConflictsWith(*b)) )
+      for (size_t b = i; b != end; ++b) {
+        if (a == b) continue;
+        const Package *other = packages[files[b].pkg];
+        if ( (conflict = pkg->ConflictsWith(*other, vercmp)) )
           break;
-        if ( (conflict = a->Replaces(*b)) )
+        if ( (conflict = pkg->Replaces(*other, vercmp)) )
           break;
       }
       if (!conflict)
-        realpkgs.push_back(a);
+        found.packages.push_back(pkg);
     }
+    if (found.packages.size() > 1)
+      out.emplace_back(move(found));
+    i = end;
+  }
+}
+
+void DB::CheckFileConflicts(const VercmpCache &vercmp) const {
+  vec<FileConflict> conflicts;
 
-    if (realpkgs.size() > 1) {
-      printf("%zu packages contain file: %s\n",
-             realpkgs.size(), std::get<0>(file)->c_str());
-      if (config_.verbosity_) {
-        for (auto &p : realpkgs)
-          printf("\t%s\n", p->name_.c_str());
+#ifdef PKGDEPDB_ENABLE_THREADS
+  if (thread::threadcount(config_) <= 1) {
+#endif
+    vec<vec<FileEntry>> files(1);
+    collect_files(packages_, 0, packages_.size(), files);
+    find_file_conflicts(files[0], packages_, vercmp, conflicts);
+#ifdef PKGDEPDB_ENABLE_THREADS
+  } else {
+    // each thread collects its files by partition, then each partition
+    // is searched for conflicts by a single thread
+    const size_t partcount = 8 * thread::threadcount(config_);
+    auto nostatus = [](unsigned long, unsigned long, unsigned long) {};
+
+    vec<vec<vec<FileEntry>>> collected;
+    auto collector = [this,partcount]
+    (std::atomic_ulong*, size_t from, size_t to, vec<vec<FileEntry>> &parts)
+    {
+      parts.resize(partcount);
+      collect_files(packages_, from, to, parts);
+    };
+    auto collected_merger = [&collected](vec<vec<vec<FileEntry>>> &&data) {
+      collected = move(data);
+    };
+    auto weight = [this](size_t i) { return packages_[i]->filelist_.size(); };
+    thread::work<vec<vec<FileEntry>>>(packages_.size(), nostatus,
+                                      collector, collected_merger,
+                                      config_, weight);
+
+    auto searcher = [this,&collected,&vercmp]
+    (std::atomic_ulong*, size_t from, size_t to, vec<FileConflict> &out) {
+      for (size_t p = from; p != to; ++p) {
+        vec<FileEntry> files;
+        for (auto &parts : collected) {
+          if (parts.empty())
+            continue;
+          files.insert(files.end(), parts[p].begin(), parts[p].end());
+          vec<FileEntry>().swap(parts[p]);
+        }
+        find_file_conflicts(files, packages_, vercmp, out);
+      }
+    };
+    auto searched_merger = [&conflicts](vec<vec<FileConflict>> &&data) {
+      for (auto &part : data) {
+        for (auto &c : part)
+          conflicts.emplace_back(move(c));
       }
+    };
+    thread::work<vec<FileConflict>>(partcount, nostatus,
+                                    searcher, searched_merger, config_);
+  }
+#endif
+
+  std::sort(conflicts.begin(), conflicts.end(),
+    [](const FileConflict &a, const FileConflict &b) {
+      return *a.path < *b.path;
+    });
+  for (auto &c : conflicts) {
+    printf("%zu packages contain file: %s\n",
+           c.packages.size(), c.path->c_str());
+    if (config_.verbosity_) {
+      for (auto &p : c.packages)
+        printf("\t%s\n", p->name_.c_str());
     }
   }
 }
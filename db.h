@@ -3,6 +3,10 @@
 
 namespace pkgdepdb {
 
+struct DepGraph;
+struct FilelistSource;
+class VercmpCache;
+
 struct DB {
   static uint16_t CURRENT;
 
@@ -22,10 +26,28 @@ struct DB {
 
 // non-serialized {
   const Config&                config_;
+  // backs the string fields of the packages and objects
+  rptr<StringPool>             strings_;
 
   bool contains_package_depends_;
   bool contains_groups_;
   bool contains_filelists_;
+  // v10 file lists are read when they are first needed, from the database
+  // file which is kept open, and locked, until then
+  std::shared_ptr<FilelistSource> filelists_source_;
+  // reading them failed, storing the database would lose them
+  bool                         filelists_failed_;
+
+  ObjIndex                     soname_index_;
+  SeekerMap                    missing_index_;
+  PkgIndex                     package_index_;
+  // the packages providing and replacing a name, in database order
+  PkgListMap                   provide_index_;
+  PkgListMap                   replace_index_;
+
+  // interned directories used by the compiled object search paths
+  std::unordered_map<string, uint32_t> dir_ids_;
+  bool                         search_paths_valid_;
 // }
 
   DB() = delete;
@@ -36,23 +58,33 @@ struct DB {
 
   bool InstallPackage(Package* &&pkg);
   bool DeletePackage (const string& name);
-  Elf *FindFor       (const Elf*, const string& lib,
-                      const StringList *extrapath) const;
-  void LinkObject    (Elf*, const Package *owner,
-                      ObjectSet &req_found,
-                      StringSet &req_missing) const;
-  void LinkObject_do (Elf*, const Package *owner);
+  Elf *FindFor       (const Elf*, istring lib) const;
+  void LinkObject    (const Elf*, vec<Elf*> &req_found,
+                      IStringSet &req_missing) const;
+  void LinkObject_do (Elf*);
+  void LinkPackage_do(Package*);
   void RelinkAll     ();
   void FixPaths      ();
   bool WipePackages  ();
   bool WipeFilelists ();
+  bool LoadFilelists ();
+  void DropFilelist  (const Package*);
 
 #ifdef PKGDEPDB_ENABLE_THREADS
   void RelinkAll_Threaded();
 #endif
 
-  Package*                    FindPkg   (const string& name) const;
-  PackageList::const_iterator FindPkg_i (const string& name) const;
+  // a view of some of the packages
+  struct PackageRange {
+    Package *const *begin_, *const *end_;
+    Package *const *begin() const { return begin_; }
+    Package *const *end()   const { return end_;   }
+  };
+
+  Package*                 FindPkg   (const string& name) const;
+  PkgIndex::const_iterator FindPkg_i (const string& name) const;
+  // the packages the filters can let through, in database order
+  PackageRange             FilterCandidates(const FilterList&) const;
 
   void ShowInfo();
   void ShowInfo_json();
@@ -70,15 +102,15 @@ struct DB {
   void ShowFilelist_json(const FilterList&, const StrFilterList&);
 
   void CheckIntegrity(const FilterList &pkg_filters,
+                      const ObjFilterList &obj_filters);
+  void CheckIntegrity(const Package       *pkg,
+                      const DepGraph      &graph,
+                      const PkgMap        &pkgmap,
+                      const PkgListMap    &providemap,
+                      const PkgListMap    &replacemap,
+                      const ObjListMap    &objmap,
                       const ObjFilterList &obj_filters) const;
-  void CheckIntegrity(const Package             *pkg,
-                      const PkgMap              &pkgmap,
-                      const PkgListMap          &providemap,
-                      const PkgListMap          &replacemap,
-                      const PkgMap              &basemap,
-                      const ObjListMap          &objmap,
-                      const vec<const Package*> &base,
-                      const ObjFilterList       &obj_filters) const;
+  void CheckFileConflicts(const VercmpCache&) const;
 
   bool Store(const string& filename);
   bool Read (const string& filename);
@@ -113,8 +145,23 @@ struct DB {
   bool IsEmpty (const Package *elf, const ObjFilterList &filters) const;
 
  private:
-  bool ElfFinds(const Elf*, const string& lib,
-                const StringList *extrapath) const;
+  bool ElfFinds(const Elf*, const Elf *lib) const;
+
+  uint32_t DirID            (const string& dir);
+  void     AddPathList      (vec<uint32_t> &out, const string& list);
+  void     CompileSearchPath(Elf*);
+  void     UpdateSearchPaths();
+
+  void IndexObject   (Elf*);
+  void UnindexObject (const Elf*);
+  void RebuildIndices();
+  void IndexProvides  (const Package*);
+  void UnindexProvides(const Package*);
+  void RebuildLinks  ();
+  void UnlinkObject  (Elf*);
+  void AddMissing    (Elf*, istring);
+  bool IsIgnored     (const Elf*) const;
+  void LinkAlias_do  (Elf*, const Elf *linked);
 
   const StringList* GetObjectLibPath(const Elf*) const;
   const StringList* GetPackageLibPath(const Package*) const;
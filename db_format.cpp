@@ -1,9 +1,13 @@
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <zlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <memory>
 #include <algorithm>
@@ -15,12 +19,21 @@
 #include "package.h"
 #include "db.h"
 #include "db_format.h"
+#include "threads.h"
+
+// the optional codecs depend on config.h
+#ifdef PKGDEPDB_ENABLE_ZSTD
+#  include <zstd.h>
+#endif
+#ifdef PKGDEPDB_ENABLE_LZ4
+#  include <lz4frame.h>
+#endif
 
 namespace pkgdepdb {
 
 // version
 uint16_t
-DB::CURRENT = 9;
+DB::CURRENT = 10;
 
 // magic header
 static const char
@@ -36,7 +49,8 @@ namespace DBFlags {
     BasePackages  = (1<<2),
     StrictLinking = (1<<3),
     AssumeFound   = (1<<4),
-    FileLists     = (1<<5)
+    FileLists     = (1<<5),
+    Indices       = (1<<6)
   };
 }
 
@@ -56,22 +70,35 @@ enum class ObjRef : uint8_t {
   PKG,
   PKGREF,
   OBJ,
-  OBJREF
+  OBJREF,
+  // v10: an object sharing the info of an earlier one of its package
+  OBJALIAS
 };
 
+// Fields are staged in a buffer so that every field is not a system call
+// of its own. Larger reads and writes bypass it.
+static const size_t serial_buffer_size = 256 * 1024;
+
 class SerialFile : public SerialStream {
  public:
-  int    fd_;
-  bool   err_;
-  size_t ppos_,
-         gpos_;
+  int       fd_;
+  bool      err_;
+  InOut     dir_;
+  size_t    ppos_,
+            gpos_;
+  vec<char> buffer_;
+  // the unread part of the buffer when reading, the filled part when
+  // writing starts at 0
+  size_t    buffer_at_,
+            buffer_end_;
 
   SerialFile(const string& file, InOut dir)
-  : ppos_(0), gpos_(0)
+  : dir_(dir), ppos_(0), gpos_(0), buffer_(serial_buffer_size),
+    buffer_at_(0), buffer_end_(0)
   {
     int locktype;
     if (dir == SerialStream::out) {
-      fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT, 0644);
       locktype = LOCK_EX;
     }
     else {
@@ -82,30 +109,113 @@ class SerialFile : public SerialStream {
       err_ = true;
       return;
     }
-    err_ = (::flock(fd_, locktype) != 0);
+    // truncated only once readers holding the lock are done
+    err_ = (::flock(fd_, locktype) != 0) ||
+           (dir == SerialStream::out && ::ftruncate(fd_, 0) != 0);
     if (err_) {
       ::close(fd_);
+      fd_ = -1;
     }
   }
 
   ~SerialFile() {
-    if (fd_ >= 0)
+    if (fd_ >= 0) {
+      if (dir_ == SerialStream::out)
+        Flush();
       ::close(fd_);
+    }
   }
 
   virtual operator bool() const { return fd_ >= 0 && !err_;
   }
 
+  bool WriteAll(const char *buf, size_t bytes) {
+    while (bytes) {
+      auto r = ::write(fd_, buf, bytes);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        err_ = true;
+        return false;
+      }
+      buf   += r;
+      bytes -= size_t(r);
+    }
+    return true;
+  }
+
+  virtual bool Flush() {
+    if (err_)
+      return false;
+    size_t fill = buffer_end_;
+    buffer_end_ = 0;
+    return WriteAll(buffer_.data(), fill);
+  }
+
+  virtual bool Rewrite(size_t at, const void *buf, size_t bytes) {
+    if (!Flush())
+      return false;
+    const char *from = (const char*)buf;
+    while (bytes) {
+      auto r = ::pwrite(fd_, from, bytes, off_t(at));
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        err_ = true;
+        return false;
+      }
+      from  += r;
+      at    += size_t(r);
+      bytes -= size_t(r);
+    }
+    return true;
+  }
+
   virtual ssize_t Write(const void *buf, size_t bytes) {
-    auto r = ::write(fd_, buf, bytes);
-    ppos_ += r;
-    return r;
+    if (buffer_.size() - buffer_end_ < bytes) {
+      if (!Flush())
+        return -1;
+      if (bytes >= buffer_.size()) {
+        if (!WriteAll((const char*)buf, bytes))
+          return -1;
+        ppos_ += bytes;
+        return ssize_t(bytes);
+      }
+    }
+    memcpy(&buffer_[buffer_end_], buf, bytes);
+    buffer_end_ += bytes;
+    ppos_       += bytes;
+    return ssize_t(bytes);
   }
 
   virtual ssize_t Read(void *buf, size_t bytes) {
-    auto r = ::read(fd_, buf, bytes);
-    gpos_ += r;
-    return r;
+    char  *out = (char*)buf;
+    size_t got = 0;
+    while (got != bytes) {
+      if (buffer_at_ == buffer_end_) {
+        bool direct = bytes - got >= buffer_.size();
+        auto r = direct ? ::read(fd_, out + got, bytes - got)
+                        : ::read(fd_, buffer_.data(), buffer_.size());
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r < 0)
+          err_ = true;
+        if (r <= 0)
+          break;
+        if (direct) {
+          got += size_t(r);
+          continue;
+        }
+        buffer_at_  = 0;
+        buffer_end_ = size_t(r);
+      }
+      size_t count = std::min(buffer_end_ - buffer_at_, bytes - got);
+      memcpy(out + got, &buffer_[buffer_at_], count);
+      buffer_at_ += count;
+      got        += count;
+    }
+    gpos_ += got;
+    return ssize_t(got);
   }
 
   virtual size_t TellP() const {
@@ -116,38 +226,115 @@ class SerialFile : public SerialStream {
   }
 };
 
+// Uncompressed databases are read straight from a read-only mapping.
+class SerialMap : public SerialStream {
+ public:
+  int         fd_;
+  const char *data_;
+  size_t      size_,
+              gpos_;
+  // a read went past the end
+  bool        err_;
+
+  explicit SerialMap(const string& file)
+  : fd_(-1), data_(nullptr), size_(0), gpos_(0), err_(false)
+  {
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (::flock(fd, LOCK_SH) != 0 || ::fstat(fd, &st) != 0) {
+      ::close(fd);
+      return;
+    }
+    size_ = size_t(st.st_size);
+    if (size_) {
+      void *map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        ::close(fd);
+        return;
+      }
+      // databases are always read from front to back
+      ::madvise(map, size_, MADV_SEQUENTIAL);
+      data_ = (const char*)map;
+    }
+    fd_ = fd;
+  }
+
+  ~SerialMap() {
+    if (data_)
+      ::munmap((void*)data_, size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  virtual operator bool() const {
+    return fd_ >= 0 && !err_;
+  }
+
+  virtual ssize_t Write(const void*, size_t) {
+    return -1;
+  }
+
+  virtual ssize_t Read(void *buf, size_t bytes) {
+    if (bytes > size_ - gpos_) {
+      bytes = size_ - gpos_;
+      err_  = true;
+    }
+    memcpy(buf, data_ + gpos_, bytes);
+    gpos_ += bytes;
+    return ssize_t(bytes);
+  }
+
+  virtual const char* Direct(size_t bytes) {
+    if (bytes > size_ - gpos_) {
+      err_ = true;
+      return nullptr;
+    }
+    const char *at = data_ + gpos_;
+    gpos_ += bytes;
+    return at;
+  }
+
+  virtual bool Flush() {
+    return true;
+  }
+
+  virtual size_t TellP() const {
+    return 0;
+  }
+  virtual size_t TellG() const {
+    return gpos_;
+  }
+};
+
+// Compressed databases are written in blocks (see SerialBlocks), the
+// streams below only read them.
 class SerialGZ : public SerialStream {
 public:
   gzFile out_;
   bool   err_;
 
-  SerialGZ(const string& file, InOut dir) {
-    int fd;
-    int locktype;
+  explicit SerialGZ(const string& file) {
     out_ = 0;
-    if (dir == SerialStream::out) {
-      fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      locktype = LOCK_EX;
-    }
-    else {
-      fd = ::open(file.c_str(), O_RDONLY);
-      locktype = LOCK_SH;
-    }
+    int fd = ::open(file.c_str(), O_RDONLY);
     if (fd < 0) {
       err_ = true;
       return;
     }
-    err_ = (::flock(fd, locktype) != 0);
+    err_ = (::flock(fd, LOCK_SH) != 0);
     if (err_) {
       ::close(fd);
       err_ = true;
       return;
     }
-    out_ = gzdopen(fd, (dir == SerialStream::out ? "wb" : "rb"));
+    out_ = gzdopen(fd, "rb");
     if (!out_) {
       err_ = true;
       ::close(fd);
+      return;
     }
+    gzbuffer(out_, serial_buffer_size);
   }
 
   ~SerialGZ() {
@@ -159,33 +346,308 @@ public:
     return out_ && !err_;
   }
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wshorten-64-to-32"
-  virtual ssize_t Write(const void *buf, size_t bytes) {
-    return gzwrite(out_, buf, bytes);
+  virtual ssize_t Write(const void*, size_t) {
+    return -1;
   }
 
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wshorten-64-to-32"
   virtual ssize_t Read(void *buf, size_t bytes) {
     return gzread(out_, buf, bytes);
   }
 #pragma clang diagnostic pop
 
+  virtual bool Flush() {
+    return true;
+  }
+
   virtual size_t TellP() const {
-    return gztell(out_);
+    return 0;
   }
   virtual size_t TellG() const {
     return gztell(out_);
   }
 };
 
+// Base for the streaming decoders: the compressed data is read through a
+// SerialFile, the uncompressed data is staged in a buffer so the codec
+// works on large chunks rather than on fields.
+class SerialCodec : public SerialStream {
+ public:
+  SerialFile file_;
+  bool       err_;
+  size_t     gpos_;
+  // compressed data read from the file
+  vec<char>  raw_;
+  size_t     raw_at_,
+             raw_end_;
+  // uncompressed data
+  vec<char>  buffer_;
+  size_t     buffer_at_,
+             buffer_end_;
+
+  explicit SerialCodec(const string& file)
+  : file_(file, SerialStream::in), err_(!file_), gpos_(0),
+    raw_at_(0), raw_end_(0),
+    buffer_(serial_buffer_size), buffer_at_(0), buffer_end_(0)
+  {}
+
+  // fills buf with up to `bytes` uncompressed bytes, 0 at the end
+  virtual ssize_t Decode(char *buf, size_t bytes) = 0;
+
+  // reads the next chunk of compressed data
+  bool FillRaw() {
+    auto r = file_.Read(raw_.data(), raw_.size());
+    if (r <= 0)
+      return false;
+    raw_at_  = 0;
+    raw_end_ = size_t(r);
+    return true;
+  }
+
+  virtual operator bool() const {
+    return !err_ && file_;
+  }
+
+  virtual ssize_t Write(const void*, size_t) {
+    return -1;
+  }
+
+  virtual ssize_t Read(void *buf, size_t bytes) {
+    char  *out = (char*)buf;
+    size_t got = 0;
+    while (got != bytes) {
+      if (buffer_at_ == buffer_end_) {
+        auto r = Decode(buffer_.data(), buffer_.size());
+        if (r < 0)
+          err_ = true;
+        if (r <= 0)
+          break;
+        buffer_at_  = 0;
+        buffer_end_ = size_t(r);
+      }
+      size_t count = std::min(buffer_end_ - buffer_at_, bytes - got);
+      memcpy(out + got, &buffer_[buffer_at_], count);
+      buffer_at_ += count;
+      got        += count;
+    }
+    gpos_ += got;
+    return ssize_t(got);
+  }
+
+  virtual const char* Direct(size_t bytes) {
+    if (buffer_end_ - buffer_at_ < bytes)
+      return nullptr;
+    const char *at = &buffer_[buffer_at_];
+    buffer_at_ += bytes;
+    gpos_      += bytes;
+    return at;
+  }
+
+  virtual bool Flush() {
+    return true;
+  }
+
+  virtual size_t TellP() const {
+    return 0;
+  }
+  virtual size_t TellG() const {
+    return gpos_;
+  }
+};
+
+#ifdef PKGDEPDB_ENABLE_ZSTD
+class SerialZstd : public SerialCodec {
+ public:
+  ZSTD_DCtx *dctx_ = nullptr;
+
+  explicit SerialZstd(const string& file)
+  : SerialCodec(file)
+  {
+    if (err_)
+      return;
+    raw_.resize(ZSTD_DStreamInSize());
+    dctx_ = ZSTD_createDCtx();
+    if (!dctx_)
+      err_ = true;
+  }
+
+  ~SerialZstd() {
+    ZSTD_freeDCtx(dctx_);
+  }
+
+  virtual ssize_t Decode(char *buf, size_t bytes) {
+    ZSTD_outBuffer out = { buf, bytes, 0 };
+    while (!out.pos) {
+      ZSTD_inBuffer in = { raw_.data(), raw_end_, raw_at_ };
+      size_t r = ZSTD_decompressStream(dctx_, &out, &in);
+      if (ZSTD_isError(r))
+        return -1;
+      raw_at_ = in.pos;
+      if (!out.pos && raw_at_ == raw_end_ && !FillRaw())
+        break;
+    }
+    return ssize_t(out.pos);
+  }
+};
+#endif
+
+#ifdef PKGDEPDB_ENABLE_LZ4
+class SerialLZ4 : public SerialCodec {
+ public:
+  LZ4F_dctx *dctx_ = nullptr;
+
+  explicit SerialLZ4(const string& file)
+  : SerialCodec(file)
+  {
+    if (err_)
+      return;
+    raw_.resize(serial_buffer_size);
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx_, LZ4F_VERSION)))
+      err_ = true;
+  }
+
+  ~SerialLZ4() {
+    if (dctx_)
+      LZ4F_freeDecompressionContext(dctx_);
+  }
+
+  virtual ssize_t Decode(char *buf, size_t bytes) {
+    size_t got = 0;
+    while (!got) {
+      size_t outsize = bytes,
+             insize  = raw_end_ - raw_at_;
+      size_t r = LZ4F_decompress(dctx_, buf, &outsize,
+                                 raw_.data() + raw_at_, &insize, nullptr);
+      if (LZ4F_isError(r))
+        return -1;
+      raw_at_ += insize;
+      got      = outsize;
+      if (!got && raw_at_ == raw_end_ && !FillRaw())
+        break;
+    }
+    return ssize_t(got);
+  }
+};
+#endif
+
+// Data in memory: output collected by SerialOut::Buffer, or input handed
+// to SerialIn::Buffer.
+class SerialBuffer : public SerialStream {
+ public:
+  vec<char> data_;
+  size_t    gpos_ = 0;
+  // a read went past the end
+  bool      err_  = false;
+
+  SerialBuffer() {}
+  explicit SerialBuffer(vec<char> &&data) : data_(move(data)) {}
+
+  virtual operator bool() const {
+    return !err_;
+  }
+
+  virtual ssize_t Write(const void *buf, size_t bytes) {
+    data_.insert(data_.end(), (const char*)buf, (const char*)buf + bytes);
+    return ssize_t(bytes);
+  }
+
+  virtual ssize_t Read(void *buf, size_t bytes) {
+    if (bytes > data_.size() - gpos_) {
+      bytes = data_.size() - gpos_;
+      err_  = true;
+    }
+    memcpy(buf, data_.data() + gpos_, bytes);
+    gpos_ += bytes;
+    return ssize_t(bytes);
+  }
+
+  virtual const char* Direct(size_t bytes) {
+    if (bytes > data_.size() - gpos_) {
+      err_ = true;
+      return nullptr;
+    }
+    const char *at = data_.data() + gpos_;
+    gpos_ += bytes;
+    return at;
+  }
+
+  virtual bool Flush() {
+    return true;
+  }
+
+  virtual size_t TellP() const {
+    return data_.size();
+  }
+  virtual size_t TellG() const {
+    return gpos_;
+  }
+};
+
+// Output which is only counted, for sizes which have to be known before
+// the data they describe is written.
+class SerialCount : public SerialStream {
+ public:
+  size_t pos_ = 0;
+
+  virtual operator bool() const {
+    return true;
+  }
+
+  virtual ssize_t Write(const void *buf, size_t bytes) {
+    (void)buf;
+    pos_ += bytes;
+    return ssize_t(bytes);
+  }
+
+  virtual ssize_t Read(void *buf, size_t bytes) {
+    (void)buf; (void)bytes;
+    return -1;
+  }
+
+  virtual bool Flush() {
+    return true;
+  }
+
+  virtual size_t TellP() const {
+    return pos_;
+  }
+  virtual size_t TellG() const {
+    return 0;
+  }
+};
+
 SerialIn::SerialIn(DB *db, SerialStream *in)
 : db_(db), in_(*in), in_owning_(in), ver8_refs_(false)
 { }
 
-SerialIn* SerialIn::Open(DB *db, const string& file, bool gz) {
-  SerialStream*
-    in = gz ? (SerialStream*)new SerialGZ  (file, SerialStream::in)
-            : (SerialStream*)new SerialFile(file, SerialStream::in);
+SerialIn* SerialIn::Open(DB *db, const string& file, Compression comp) {
+  SerialStream *in = nullptr;
+  switch (comp) {
+    case Compression::None:
+      in = new SerialMap(file);
+      // fall back to reading when the file cannot be mapped
+      if (!*in) {
+        delete in;
+        in = new SerialFile(file, SerialStream::in);
+      }
+      break;
+    case Compression::GZip:
+      in = new SerialGZ(file);
+      break;
+#ifdef PKGDEPDB_ENABLE_ZSTD
+    case Compression::Zstd:
+      in = new SerialZstd(file);
+      break;
+#endif
+#ifdef PKGDEPDB_ENABLE_LZ4
+    case Compression::LZ4:
+      in = new SerialLZ4(file);
+      break;
+#endif
+    default:
+      break;
+  }
 
   if (!in)
     return 0;
@@ -198,18 +660,17 @@ SerialIn* SerialIn::Open(DB *db, const string& file, bool gz) {
   return s;
 }
 
+SerialIn* SerialIn::Buffer(DB *db, vec<char> &&data) {
+  return new SerialIn(db, new SerialBuffer(move(data)));
+}
+
 SerialOut::SerialOut(DB *db, SerialStream *out)
 : db_(db), out_(*out), out_owning_(out)
 { }
 
-SerialOut* SerialOut::Open(DB *db, const string& file, bool gz)
+SerialOut* SerialOut::Open(DB *db, const string& file)
 {
-  SerialStream*
-    out = gz ? (SerialStream*)new SerialGZ  (file, SerialStream::out)
-             : (SerialStream*)new SerialFile(file, SerialStream::out);
-
-  if (!out) 
-    return 0;
+  SerialStream *out = new SerialFile(file, SerialStream::out);
   if (!*out) {
     delete out;
     return 0;
@@ -219,6 +680,33 @@ SerialOut* SerialOut::Open(DB *db, const string& file, bool gz)
   return s;
 }
 
+SerialOut* SerialOut::Buffer(DB *db) {
+  auto buffer = new SerialBuffer;
+  SerialOut *s = new SerialOut(db, buffer);
+  s->buffer_ = buffer;
+  return s;
+}
+
+SerialOut* SerialOut::Count(DB *db) {
+  return new SerialOut(db, new SerialCount);
+}
+
+SerialOut* SerialOut::Wrap(DB *db, SerialStream *out) {
+  return new SerialOut(db, out);
+}
+
+const vec<char>& SerialOut::Buffered() const {
+  return buffer_->data_;
+}
+
+uint32_t SerialOut::GetStrRef(const istring &s) {
+  auto id = static_cast<uint32_t>(strtab_.size());
+  auto added = strref_.emplace(s.s_, id);
+  if (added.second)
+    strtab_.push_back(s.s_);
+  return added.first->second;
+}
+
 bool SerialOut::GetObjRef(const Elf *e, size_t *out) {
   auto exists = objref_.find(e);
   if (exists != objref_.end()) {
@@ -245,8 +733,7 @@ static bool write_obj(SerialOut &out, const Elf *obj);
 static bool read_obj (SerialIn  &in,  rptr<Elf> &obj, const Config&);
 
 bool write_objlist(SerialOut &out, const ObjectList& list) {
-  auto len = static_cast<uint32_t>(list.size());
-  out.out_.Write((const char*)&len, sizeof(len));
+  write_count(out, list.size());
   for (auto &obj : list) {
     if (!write_obj(out, obj))
       return false;
@@ -256,7 +743,8 @@ bool write_objlist(SerialOut &out, const ObjectList& list) {
 
 bool read_objlist(SerialIn &in, ObjectList& list, const Config& config) {
   uint32_t len;
-  in >= len;
+  if (!read_count(in, len))
+    return false;
   list.resize(len);
   for (size_t i = 0; i != len; ++i) {
     if (!read_obj(in, list[i], config))
@@ -266,8 +754,7 @@ bool read_objlist(SerialIn &in, ObjectList& list, const Config& config) {
 }
 
 bool write_objset(SerialOut &out, const ObjectSet& list) {
-  auto len = static_cast<uint32_t>(list.size());
-  out.out_.Write((const char*)&len, sizeof(len));
+  write_count(out, list.size());
   for (auto &obj : list) {
     if (!write_obj(out, obj))
       return false;
@@ -284,7 +771,8 @@ bool read_objset(SerialIn &in, ObjectSet& list, const Config& config) {
   new (&list) ObjectSet(lst.begin(), lst.end());
 #else
   uint32_t len;
-  in >= len;
+  if (!read_count(in, len))
+    return false;
   for (size_t i = 0; i != len; ++i) {
     rptr<Elf> obj;
     if (!read_obj(in, obj, config))
@@ -296,17 +784,17 @@ bool read_objset(SerialIn &in, ObjectSet& list, const Config& config) {
 }
 
 bool write_stringlist(SerialOut &out, const vec<string> &list) {
-  auto len = static_cast<uint32_t>(list.size());
-  out.out_.Write((const char*)&len, sizeof(len));
+  write_count(out, list.size());
   for (auto &s : list)
     out <= s;
   return out.out_;
 }
 
 bool read_stringlist(SerialIn &in, vec<string> &list) {
-  static string s;
+  string s;
   uint32_t len;
-  in >= len;
+  if (!read_count(in, len))
+    return false;
   list.reserve(len);
   for (uint32_t i = 0; i != len; ++i) {
     in >= s;
@@ -316,8 +804,7 @@ bool read_stringlist(SerialIn &in, vec<string> &list) {
 }
 
 bool write_stringset(SerialOut &out, const StringSet &list) {
-  auto len = static_cast<uint32_t>(list.size());
-  out.out_.Write((const char*)&len, sizeof(len));
+  write_count(out, list.size());
   for (auto &s : list)
     out <= s;
   return out.out_;
@@ -333,7 +820,8 @@ bool read_stringset(SerialIn &in, StringSet &list) {
 #else
   // "HINTS"... yeah right :P
   uint32_t len;
-  in >= len;
+  if (!read_count(in, len))
+    return false;
   StringSet::iterator hint = list.end();
   for (uint32_t i = 0; i != len; ++i) {
     string str;
@@ -344,35 +832,125 @@ bool read_stringset(SerialIn &in, StringSet &list) {
   return in.in_;
 }
 
-static bool write_obj(SerialOut &out, const Elf *obj) {
-  // check if the object has already been serialized
+bool write_stringlist(SerialOut &out, const IStringList &list) {
+  write_count(out, list.size());
+  for (auto &s : list)
+    out <= s;
+  return out.out_;
+}
 
-  size_t ref = (size_t)-1;
-  if (out.GetObjRef(obj, &ref)) {
-    out <= ObjRef::OBJREF <= ref;
-    return true;
-  }
+bool read_stringlist(SerialIn &in, IStringList &list) {
+  uint32_t len;
+  if (!read_count(in, len))
+    return false;
+  list.resize(len);
+  for (uint32_t i = 0; i != len; ++i)
+    in >= list[i];
+  return in.in_;
+}
 
-  // OBJ ObjRef; and remember our pointer in the ObjOutMap
-  out <= ObjRef::OBJ;
+bool write_dependlist(SerialOut &out, const DependList &list) {
+  write_count(out, list.size());
+  for (auto &d : list)
+    out <= d.full_;
+  return out.out_;
+}
 
-  // Serialize the actual object data
-  out <= obj->dirname_
-      <= obj->basename_
-      <= obj->ei_class_
-      <= obj->ei_data_
-      <= obj->ei_osabi_
-      <= (uint8_t)obj->rpath_set_
-      <= (uint8_t)obj->runpath_set_
-      <= obj->rpath_
-      <= obj->runpath_;
-  if (out.version_ >= 9)
-    out <= (uint8_t)obj->interpreter_set_ <= obj->interpreter_;
+bool read_dependlist(SerialIn &in, DependList &list) {
+  uint32_t len;
+  if (!read_count(in, len))
+    return false;
+  list.reserve(len);
+  istring s;
+  for (uint32_t i = 0; i != len; ++i) {
+    in >= s;
+    list.emplace_back(s.str(), *in.db_->strings_);
+  }
+  return in.in_;
+}
+
+bool write_strtab(SerialOut &out, const SerialOut &strings) {
+  write_count(out, strings.strtab_.size());
+  for (const string *s : strings.strtab_)
+    out <= *s;
+  return out.out_;
+}
 
-  if (!write_stringlist(out, obj->needed_))
+bool read_strtab(SerialIn &in) {
+  uint32_t len;
+  if (!read_count(in, len))
     return false;
+  in.strtab_ = std::make_shared<vec<istring>>(len);
+  string s;
+  for (auto &str : *in.strtab_) {
+    in >= s;
+    str = in.db_->strings_->Get(move(s));
+  }
+  return in.in_ && !in.bad_string_;
+}
 
-  return true;
+bool write_stringset(SerialOut &out, const IStringSet &list) {
+  write_count(out, list.size());
+  for (auto &s : list)
+    out <= s;
+  return out.out_;
+}
+
+bool read_stringset(SerialIn &in, IStringSet &list) {
+  uint32_t len;
+  if (!read_count(in, len))
+    return false;
+  istring str;
+  for (uint32_t i = 0; i != len; ++i) {
+    in >= str;
+    list.insert(list.end(), str);
+  }
+  return in.in_;
+}
+
+static bool write_obj(SerialOut &out, const Elf *obj) {
+  // check if the object has already been serialized
+
+  size_t ref = (size_t)-1;
+  if (out.GetObjRef(obj, &ref)) {
+    out <= ObjRef::OBJREF;
+    write_ref(out, ref);
+    return true;
+  }
+
+  // symlinks and other objects with the info of one already written only
+  // need their path, the distance back to that one's ref is stored
+  if (out.version_ >= 10) {
+    auto info = out.inforef_.emplace(obj, ref);
+    if (!info.second) {
+      out <= ObjRef::OBJALIAS;
+      write_ref(out, ref - info.first->second);
+      out <= obj->dirname_
+          <= obj->basename_;
+      return true;
+    }
+  }
+
+  // OBJ ObjRef; and remember our pointer in the ObjOutMap
+  out <= ObjRef::OBJ;
+
+  // Serialize the actual object data
+  out <= obj->dirname_
+      <= obj->basename_
+      <= obj->ei_class_
+      <= obj->ei_data_
+      <= obj->ei_osabi_
+      <= (uint8_t)obj->info_->rpath_set_
+      <= (uint8_t)obj->info_->runpath_set_
+      <= obj->info_->rpath_
+      <= obj->info_->runpath_;
+  if (out.version_ >= 9)
+    out <= (uint8_t)obj->info_->interpreter_set_ <= obj->info_->interpreter_;
+
+  if (!write_stringlist(out, obj->info_->needed_))
+    return false;
+
+  return true;
 }
 
 static bool read_obj(SerialIn &in, rptr<Elf> &obj, const Config& config) {
@@ -380,7 +958,8 @@ static bool read_obj(SerialIn &in, rptr<Elf> &obj, const Config& config) {
   in >= r;
   size_t ref;
   if (r == ObjRef::OBJREF) {
-    in >= ref;
+    if (!read_ref(in, ref))
+      return false;
     if (in.ver8_refs_) {
       if (ref >= in.objref_.size()) {
         config.Log(Error, "db error: objref out of range [%zu/%zu]\n", ref,
@@ -398,6 +977,20 @@ static bool read_obj(SerialIn &in, rptr<Elf> &obj, const Config& config) {
     }
     return true;
   }
+  if (r == ObjRef::OBJALIAS && in.version_ >= 10) {
+    if (!read_ref(in, ref))
+      return false;
+    if (!ref || ref > in.objref_.size()) {
+      config.Log(Error, "db error: object alias out of range [%zu/%zu]\n",
+                 ref, in.objref_.size());
+      return false;
+    }
+    obj = new Elf(*in.objref_[in.objref_.size() - ref]);
+    in.objref_.push_back(obj.get());
+    in >= obj->dirname_
+       >= obj->basename_;
+    return true;
+  }
   if (r != ObjRef::OBJ) {
     config.Log(Error, "object expected, object-ref value: %u\n", (unsigned)r);
     return false;
@@ -423,15 +1016,15 @@ static bool read_obj(SerialIn &in, rptr<Elf> &obj, const Config& config) {
      >= obj->ei_osabi_
      >= rpset
      >= runpset
-     >= obj->rpath_
-     >= obj->runpath_;
+     >= obj->info_->rpath_
+     >= obj->info_->runpath_;
   if (in.version_ >= 9)
-    in >= interpset >= obj->interpreter_;
-  obj->rpath_set_       = rpset;
-  obj->runpath_set_     = runpset;
-  obj->interpreter_set_ = interpset;
+    in >= interpset >= obj->info_->interpreter_;
+  obj->info_->rpath_set_       = rpset;
+  obj->info_->runpath_set_     = runpset;
+  obj->info_->interpreter_set_ = interpset;
 
-  if (!read_stringlist(in, obj->needed_))
+  if (!read_stringlist(in, obj->info_->needed_))
     return false;
 
   return true;
@@ -443,7 +1036,8 @@ static bool write_pkg(SerialOut &out,    Package  *pkg,
   // check if the package has already been serialized
   size_t ref = (size_t)-1;
   if (out.GetPkgRef(pkg, &ref)) {
-    out <= ObjRef::PKGREF <= ref;
+    out <= ObjRef::PKGREF;
+    write_ref(out, ref);
     return true;
   }
 
@@ -453,20 +1047,25 @@ static bool write_pkg(SerialOut &out,    Package  *pkg,
   // Now serialize the actual package data:
   out <= pkg->name_
       <= pkg->version_;
-  if (!write_objlist(out, pkg->objects_))
+  // only the objects of one package are aliases of each other, objects
+  // written later must not refer to them
+  out.inforef_.clear();
+  bool objects_ok = write_objlist(out, pkg->objects_);
+  out.inforef_.clear();
+  if (!objects_ok)
     return false;
 
   if (hdrver >= 3) {
-    if (!write_stringlist(out, pkg->depends_) ||
-        !write_stringlist(out, pkg->optdepends_))
+    if (!write_dependlist(out, pkg->depends_) ||
+        !write_dependlist(out, pkg->optdepends_))
     {
       return false;
     }
   }
   if (hdrver >= 4) {
-    if (!write_stringlist(out, pkg->provides_)  ||
-        !write_stringlist(out, pkg->conflicts_) ||
-        !write_stringlist(out, pkg->replaces_))
+    if (!write_dependlist(out, pkg->provides_)  ||
+        !write_dependlist(out, pkg->conflicts_) ||
+        !write_dependlist(out, pkg->replaces_))
     {
       return false;
     }
@@ -474,12 +1073,37 @@ static bool write_pkg(SerialOut &out,    Package  *pkg,
   if (hdrver >= 5 && !write_stringset(out, pkg->groups_))
     return false;
 
-  if (flags & DBFlags::FileLists && !write_stringlist(out, pkg->filelist_))
+  // v10 writes the file lists in a section of their own
+  if (hdrver < 10 && flags & DBFlags::FileLists &&
+      !write_stringlist(out, pkg->filelist_))
+  {
     return false;
+  }
 
   return true;
 }
 
+size_t ObjInfoHash::operator()(const Elf *obj) const {
+  return obj->info_->Hash() ^ obj->ei_class_;
+}
+
+bool ObjInfoEqual::operator()(const Elf *a, const Elf *b) const {
+  return a->ei_class_ == b->ei_class_ &&
+         a->ei_data_  == b->ei_data_  &&
+         a->ei_osabi_ == b->ei_osabi_ &&
+         (a->info_.get() == b->info_.get() || *a->info_ == *b->info_);
+}
+
+// Before v10 symlinks to a file are stored as objects of their own, let
+// them share the file's info again. Objects of one package with the same
+// class and equal info link the same way, so sharing it is safe for any of
+// them.
+static void share_objinfo(ObjectList &objects) {
+  std::unordered_set<Elf*, ObjInfoHash, ObjInfoEqual> files;
+  for (auto &obj : objects)
+    obj->info_ = (*files.insert(obj).first)->info_;
+}
+
 static bool read_pkg(SerialIn &in,     Package  *&pkg,
                      unsigned  hdrver, HdrFlags  flags,
                      const Config& config)
@@ -488,7 +1112,8 @@ static bool read_pkg(SerialIn &in,     Package  *&pkg,
   in >= r;
   size_t ref;
   if (r == ObjRef::PKGREF) {
-    in >= ref;
+    if (!read_ref(in, ref))
+      return false;
     if (in.ver8_refs_) {
       if (ref >= in.pkgref_.size()) {
         config.Log(Error, "db error: pkgref out of range [%zu/%zu]\n", ref,
@@ -528,18 +1153,20 @@ static bool read_pkg(SerialIn &in,     Package  *&pkg,
     return false;
   for (auto &o : pkg->objects_)
     o->owner_ = pkg;
+  if (hdrver < 10)
+    share_objinfo(pkg->objects_);
 
   if (hdrver >= 3) {
-    if (!read_stringlist(in, pkg->depends_) ||
-        !read_stringlist(in, pkg->optdepends_))
+    if (!read_dependlist(in, pkg->depends_) ||
+        !read_dependlist(in, pkg->optdepends_))
     {
       return false;
     }
   }
   if (hdrver >= 4) {
-    if (!read_stringlist(in, pkg->provides_) ||
-        !read_stringlist(in, pkg->conflicts_) ||
-        !read_stringlist(in, pkg->replaces_))
+    if (!read_dependlist(in, pkg->provides_) ||
+        !read_dependlist(in, pkg->conflicts_) ||
+        !read_dependlist(in, pkg->replaces_))
     {
       return false;
     }
@@ -547,95 +1174,580 @@ static bool read_pkg(SerialIn &in,     Package  *&pkg,
   if (hdrver >= 5 && !read_stringset(in, pkg->groups_))
     return false;
 
-  if (flags & DBFlags::FileLists && !read_stringlist(in, pkg->filelist_))
+  if (hdrver < 10 && flags & DBFlags::FileLists &&
+      !read_stringlist(in, pkg->filelist_))
+  {
     return false;
+  }
 
   return true;
 }
 
-static inline bool ends_with_gz(const string& str) {
-  size_t pos = str.find_last_of('.');
-  return (pos == str.length()-3 &&
-          str.compare(pos, 3, ".gz") == 0);
+// The lookup indices are stored so that reading a database does not have
+// to rebuild them: the directory table with every object's directory and
+// compiled search path, then soname -> objects, name -> package, and
+// provides and replaces -> packages. Strings and objects are referenced
+// like in the rest of the data, which is passed as refs.
+// the entries of an index by name, so that storing the same database
+// twice gives the same bytes
+template<typename Index>
+static vec<const typename Index::value_type*> by_name(const Index &index) {
+  vec<const typename Index::value_type*> entries;
+  entries.reserve(index.size());
+  for (auto &entry : index)
+    entries.push_back(&entry);
+  std::sort(entries.begin(), entries.end(),
+    [](const typename Index::value_type *a,
+       const typename Index::value_type *b)
+    {
+      return a->first < b->first;
+    });
+  return entries;
 }
 
-static bool db_store(DB *db, const string& filename) {
-  bool mkgzip = ends_with_gz(filename);
-  uniq<SerialOut> sout(SerialOut::Open(db, filename, mkgzip));
+static bool write_indices(SerialOut &out, SerialOut &refs) {
+  DB *db = refs.db_;
+
+  vec<const string*> dirs(db->dir_ids_.size());
+  for (auto &dir : db->dir_ids_)
+    dirs[dir.second] = &dir.first;
+  write_count(out, dirs.size());
+  for (auto dir : dirs)
+    out <= *dir;
+
+  write_count(out, db->objects_.size());
+  for (auto &obj : db->objects_) {
+    write_count(out, obj->dir_id_);
+    write_count(out, obj->search_path_.size());
+    for (auto dir : obj->search_path_)
+      write_count(out, dir);
+  }
 
-  if (mkgzip)
-    db->config_.Log(Message, "writing compressed database\n");
-  else
-    db->config_.Log(Message, "writing database\n");
+  size_t ref;
+  write_count(out, db->soname_index_.size());
+  for (auto entry : by_name(db->soname_index_)) {
+    write_count(out, entry->second.size());
+    for (auto obj : entry->second) {
+      if (!refs.GetObjRef(obj, &ref))
+        return false;
+      write_ref(out, ref);
+    }
+  }
 
-  SerialOut &out(*sout);
+  // packages are referred to by their position
+  write_count(out, db->package_index_.size());
+  for (auto entry : by_name(db->package_index_)) {
+    if (!refs.GetPkgRef(entry->second, &ref))
+      return false;
+    write_ref(out, ref);
+  }
 
-  if (!sout || !out.out_) {
-    db->config_.Log(Error, "failed to open file %s for writing\n",
-                    filename.c_str());
+  for (auto index : { &db->provide_index_, &db->replace_index_ }) {
+    write_count(out, index->size());
+    for (auto entry : by_name(*index)) {
+      write_varint(out, refs.GetStrRef(entry->first));
+      write_count(out, entry->second.size());
+      for (auto pkg : entry->second) {
+        if (!refs.GetPkgRef(pkg, &ref))
+          return false;
+        write_ref(out, ref);
+      }
+    }
+  }
+  return out.out_;
+}
+
+// Fails on anything which does not fit the database read so far, the
+// caller then drops what was read and rebuilds the indices.
+static bool read_indices(SerialIn &in) {
+  DB *db = in.db_;
+  uint32_t count, len, id;
+
+  if (!read_count(in, count))
     return false;
+  for (uint32_t i = 0; i != count; ++i) {
+    string dir;
+    in >= dir;
+    if (in.bad_string_ || !db->dir_ids_.emplace(move(dir), i).second)
+      return false;
   }
 
-  Header hdr;
-  memset(&hdr, 0, sizeof(hdr));
+  if (!read_count(in, len) || len != db->objects_.size())
+    return false;
+  for (auto &obj : db->objects_) {
+    if (!read_count(in, id) || id >= count || !read_count(in, len))
+      return false;
+    obj->dir_id_ = id;
+    obj->search_path_.resize(len);
+    for (auto &dir : obj->search_path_) {
+      if (!read_count(in, dir) || dir >= count)
+        return false;
+    }
+  }
 
-  memcpy(hdr.magic, depdb_magic, sizeof(hdr.magic));
-  hdr.version = 1;
+  size_t ref;
+  if (!read_count(in, count))
+    return false;
+  db->soname_index_.reserve(count);
+  for (uint32_t i = 0; i != count; ++i) {
+    if (!read_count(in, len) || !len)
+      return false;
+    vec<Elf*> objects(len);
+    for (auto &obj : objects) {
+      if (!read_ref(in, ref) || ref >= in.objref_.size())
+        return false;
+      obj = in.objref_[ref];
+    }
+    istring name(objects[0]->basename_);
+    if (!db->soname_index_.emplace(name, move(objects)).second)
+      return false;
+  }
 
-  // flags:
-  if (db->ignore_file_rules_.size())
-    hdr.flags |= DBFlags::IgnoreRules;
-  if (db->package_library_path_.size())
-    hdr.flags |= DBFlags::PackageLDPath;
-  if (db->base_packages_.size())
-    hdr.flags |= DBFlags::BasePackages;
-  if (db->strict_linking_)
-    hdr.flags |= DBFlags::StrictLinking;
-  if (db->assume_found_rules_.size())
-    hdr.flags |= DBFlags::AssumeFound;
-  if (db->contains_filelists_)
-    hdr.flags |= DBFlags::FileLists;
+  if (!read_count(in, count))
+    return false;
+  db->package_index_.reserve(count);
+  for (uint32_t i = 0; i != count; ++i) {
+    if (!read_ref(in, ref) || ref >= db->packages_.size())
+      return false;
+    db->package_index_.emplace(db->packages_[ref]->name_,
+                               db->packages_[ref]);
+  }
 
-  // Figure out which database format version this will be
-  if (hdr.flags & DBFlags::FileLists)
-    hdr.version = 7;
-  else if (hdr.flags & DBFlags::AssumeFound)
-    hdr.version = 6;
-  else if (db->contains_groups_)
-    hdr.version = 5;
-  else if (db->contains_package_depends_)
-    hdr.version = 4;
-  else if (hdr.flags)
-      hdr.version = 2;
+  for (auto index : { &db->provide_index_, &db->replace_index_ }) {
+    if (!read_count(in, count))
+      return false;
+    for (uint32_t i = 0; i != count; ++i) {
+      uint64_t name;
+      if (!read_varint(in, name) || name >= in.strtab_->size() ||
+          !read_count(in, len))
+      {
+        return false;
+      }
+      auto &packages = (*index)[(*in.strtab_)[name]];
+      packages.resize(len);
+      for (auto &pkg : packages) {
+        if (!read_ref(in, ref) || ref >= in.pkgref_.size())
+          return false;
+        pkg = in.pkgref_[ref];
+      }
+    }
+  }
 
-  // okay
+  db->search_paths_valid_ = true;
+  return in.in_;
+}
 
-  // ver8 introduces faster refs...
-  if (hdr.version < 8)
-    hdr.version = 8;
+static inline bool ends_with(const string& str, const char *ext) {
+  size_t len = strlen(ext);
+  return str.length() >= len &&
+         str.compare(str.length()-len, len, ext) == 0;
+}
 
-  // ver9 contains interpreter data
-  if (hdr.version < 9)
-    hdr.version = 9;
+// the compression is chosen by the file extension
+static Compression file_compression(const string& filename) {
+  if (ends_with(filename, ".gz"))
+    return Compression::GZip;
+  if (ends_with(filename, ".zst"))
+    return Compression::Zstd;
+  if (ends_with(filename, ".lz4"))
+    return Compression::LZ4;
+  return Compression::None;
+}
 
-  out.version_ = hdr.version;
-  out <= hdr;
-  out <= db->name_;
-  if (!write_stringlist(out, db->library_path_))
+static bool compression_supported(Compression comp, const Config& config) {
+  const char *name = nullptr;
+  (void)comp;
+#ifndef PKGDEPDB_ENABLE_ZSTD
+  if (comp == Compression::Zstd)
+    name = "zstd";
+#endif
+#ifndef PKGDEPDB_ENABLE_LZ4
+  if (comp == Compression::LZ4)
+    name = "lz4";
+#endif
+  if (!name)
+    return true;
+  config.Log(Error, "this build of pkgdepdb does not support %s compressed "
+                    "databases\n", name);
+  return false;
+}
+
+// --compression-level allows the highest level of any codec, higher ones
+// than the codec written supports are capped
+static unsigned compression_level(Compression comp, const Config& config) {
+  unsigned    level = config.compression_level_,
+              max;
+  const char *name;
+  switch (comp) {
+    case Compression::GZip: max =  9; name = "gzip"; break;
+    case Compression::Zstd: max = 22; name = "zstd"; break;
+    // levels above 2 use lz4's high compression mode, up to 12
+    case Compression::LZ4:  max = 12; name = "lz4";  break;
+    default:
+      return level;
+  }
+  if (level <= max)
+    return level;
+  config.Log(Warn, "%s compression goes up to level %u, using %u instead "
+                   "of %u\n", name, max, max, level);
+  return max;
+}
+
+// Compressed databases are written as a series of independently compressed
+// blocks: the header with the string table up to the package count, runs
+// of packages, the rest, and the file lists. Every block is a complete gzip
+// member, zstd frame or lz4 frame, so the file as a whole still
+// decompresses to the plain database. A block index in front lets threaded
+// builds decompress and read the package blocks in parallel, and lets the
+// file lists be found without decompressing the rest. For zstd and lz4 it
+// is a skippable frame, for gzip the extra field of an empty member.
+struct DataBlock {
+  size_t   size,
+           csize;
+  uint32_t packages;
+  // the number of objects first serialized in the block
+  uint32_t objects;
+};
+
+static const size_t db_block_size = 1024 * 1024;
+
+// Blocks are compressed in a single call and their sizes are stored as 32
+// bit counts. The head and the tail cannot be split, so blocks are limited
+// to this instead.
+static const size_t db_block_max = 1024 * 1024 * 1024;
+
+static const char block_index_magic[] = { 'D', 'B', 'l', 'k' };
+
+// zstd and lz4 decoders skip frames starting with this
+static const uint32_t skippable_frame_magic = 0x184D2A50;
+
+// runs fn(i) for i in [0, count), on multiple threads when available
+static void each_block(size_t count, const function<void(size_t)> &fn,
+                       const Config &config)
+{
+#ifdef PKGDEPDB_ENABLE_THREADS
+  if (count > 1 && thread::threadcount(config) > 1) {
+    auto nostatus = [](unsigned long, unsigned long, unsigned long) {};
+    auto worker = [&fn](std::atomic_ulong*, size_t from, size_t to, int&) {
+      for (size_t i = from; i != to; ++i)
+        fn(i);
+    };
+    auto merger = [](vec<int>&&) {};
+    thread::work<int>(count, nostatus, worker, merger, config);
+    return;
+  }
+#else
+  (void)config;
+#endif
+  for (size_t i = 0; i != count; ++i)
+    fn(i);
+}
+
+static bool compress_block(Compression comp, unsigned level,
+                           const char *data, size_t size, vec<char> &out)
+{
+  switch (comp) {
+    case Compression::GZip: {
+      z_stream z;
+      memset(&z, 0, sizeof(z));
+      int zlevel = level ? int(std::min(level, 9u)) : Z_DEFAULT_COMPRESSION;
+      // +16: with a gzip header
+      if (deflateInit2(&z, zlevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)
+          != Z_OK)
+      {
+        return false;
+      }
+      out.resize(deflateBound(&z, size));
+      z.next_in   = (Bytef*)data;
+      z.avail_in  = uInt(size);
+      z.next_out  = (Bytef*)out.data();
+      z.avail_out = uInt(out.size());
+      bool ok = deflate(&z, Z_FINISH) == Z_STREAM_END;
+      out.resize(z.total_out);
+      deflateEnd(&z);
+      return ok;
+    }
+#ifdef PKGDEPDB_ENABLE_ZSTD
+    case Compression::Zstd: {
+      out.resize(ZSTD_compressBound(size));
+      size_t w = ZSTD_compress(out.data(), out.size(), data, size,
+                               int(level));
+      if (ZSTD_isError(w))
+        return false;
+      out.resize(w);
+      return true;
+    }
+#endif
+#ifdef PKGDEPDB_ENABLE_LZ4
+    case Compression::LZ4: {
+      LZ4F_preferences_t prefs;
+      memset(&prefs, 0, sizeof(prefs));
+      prefs.compressionLevel = int(level);
+      out.resize(LZ4F_compressFrameBound(size, &prefs));
+      size_t w = LZ4F_compressFrame(out.data(), out.size(), data, size,
+                                    &prefs);
+      if (LZ4F_isError(w))
+        return false;
+      out.resize(w);
+      return true;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+static inline void put_le(vec<char> &out, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i != bytes; ++i)
+    out.push_back(char(value >> (8*i)));
+}
+
+// puts the index into a frame the decompressors skip
+static bool wrap_block_index(Compression comp, const vec<char> &index,
+                             vec<char> &out)
+{
+  if (comp == Compression::GZip) {
+    // the extra field is limited to 64k including the subfield header
+    if (index.size() > 0xFFFF - 4)
+      return false;
+    static const char head[] = {
+      '\x1f', '\x8b', 8, 4 /* FEXTRA */, 0, 0, 0, 0, 0, '\xff'
+    };
+    // an empty final block, the crc and the size of nothing
+    static const char tail[] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    out.assign(head, head + sizeof(head));
+    put_le(out, uint32_t(index.size() + 4), 2);
+    out.push_back('P');
+    out.push_back('D');
+    put_le(out, uint32_t(index.size()), 2);
+    out.insert(out.end(), index.begin(), index.end());
+    out.insert(out.end(), tail, tail + sizeof(tail));
+    return true;
+  }
+  out.clear();
+  put_le(out, skippable_frame_magic, 4);
+  put_le(out, uint32_t(index.size()), 4);
+  out.insert(out.end(), index.begin(), index.end());
+  return true;
+}
+
+// The compressed size takes a fixed width in the index, which is written
+// before the blocks are compressed and filled in afterwards.
+static void write_csize(SerialOut &out, size_t csize) {
+  uint8_t buf[5];
+  auto value = uint32_t(csize);
+  for (size_t i = 0; i != 4; ++i, value >>= 7)
+    buf[i] = uint8_t(value) | 0x80;
+  buf[4] = uint8_t(value);
+  out.out_.Write(buf, sizeof(buf));
+}
+
+static bool block_index_frame(DB *db, Compression comp, uint16_t version,
+                              const vec<DataBlock> &blocks,
+                              size_t filelist_blocks, vec<char> &frame)
+{
+  uniq<SerialOut> sindex(SerialOut::Buffer(db));
+  SerialOut &index(*sindex);
+  index.version_ = version;
+  index.out_.Write(block_index_magic, sizeof(block_index_magic));
+  write_count(index, blocks.size());
+  for (auto &b : blocks) {
+    write_count(index, b.size);
+    write_csize(index, b.csize);
+    write_count(index, b.packages);
+    write_count(index, b.objects);
+  }
+  // the last blocks hold the file lists
+  write_count(index, filelist_blocks);
+  return wrap_block_index(comp, index.Buffered(), frame);
+}
+
+// Collects the blocks, whose sizes are known from the first pass, as they
+// are written. Complete blocks are compressed up to one per thread at a
+// time and written out in order.
+class SerialBlocks : public SerialStream {
+ public:
+  SerialStream   &out_;
+  Compression     comp_;
+  unsigned        level_;
+  vec<DataBlock> &blocks_;
+  const Config   &config_;
+  size_t          batch_size_ = 1,
+                  done_       = 0,
+                  pos_        = 0;
+  // complete blocks which are not compressed yet, and the one being filled
+  vec<vec<char>>  batch_;
+  vec<char>       fill_;
+  bool            err_        = false;
+
+  SerialBlocks(SerialStream &out, Compression comp, unsigned level,
+               vec<DataBlock> &blocks, const Config &config)
+  : out_(out), comp_(comp), level_(level), blocks_(blocks), config_(config)
+  {
+#ifdef PKGDEPDB_ENABLE_THREADS
+    batch_size_ = std::max(1ul, thread::threadcount(config));
+#endif
+  }
+
+  virtual operator bool() const {
+    return !err_ && out_;
+  }
+
+  virtual ssize_t Write(const void *buf, size_t bytes) {
+    const char *from = (const char*)buf;
+    size_t      left = bytes;
+    while (left) {
+      size_t i = done_ + batch_.size();
+      if (i == blocks_.size()) {
+        err_ = true;
+        return -1;
+      }
+      size_t count = std::min(left, blocks_[i].size - fill_.size());
+      if (fill_.empty())
+        fill_.reserve(blocks_[i].size);
+      fill_.insert(fill_.end(), from, from + count);
+      from += count;
+      left -= count;
+      if (fill_.size() == blocks_[i].size) {
+        batch_.emplace_back(move(fill_));
+        fill_.clear();
+        if (batch_.size() == batch_size_ && !Compress())
+          return -1;
+      }
+    }
+    pos_ += bytes;
+    return ssize_t(bytes);
+  }
+
+  bool Compress() {
+    each_block(batch_.size(), [&](size_t b) {
+      vec<char> compressed;
+      if (compress_block(comp_, level_, batch_[b].data(), batch_[b].size(),
+                         compressed))
+      {
+        blocks_[done_ + b].csize = compressed.size();
+      }
+      batch_[b] = move(compressed);
+    }, config_);
+    for (auto &data : batch_) {
+      // a compressed block is never empty
+      if (!blocks_[done_].csize ||
+          out_.Write(data.data(), data.size()) != ssize_t(data.size()))
+      {
+        err_ = true;
+        return false;
+      }
+      ++done_;
+    }
+    batch_.clear();
+    return true;
+  }
+
+  virtual ssize_t Read(void *buf, size_t bytes) {
+    (void)buf; (void)bytes;
+    return -1;
+  }
+
+  // everything has to have been written by now
+  virtual bool Flush() {
+    if (err_ || (!batch_.empty() && !Compress()))
+      return false;
+    return done_ == blocks_.size() && fill_.empty() && out_.Flush();
+  }
+
+  virtual size_t TellP() const {
+    return pos_;
+  }
+  virtual size_t TellG() const {
+    return 0;
+  }
+};
+
+// v10 file lists stay in the file until something needs them. It is read
+// from what was used for the rest of the data: either the stream which
+// stopped where they start, or the mapped file with the compressed blocks
+// holding them. Storing the database copies the lists which were not
+// needed as they are, without parsing them.
+struct FilelistSource {
+  string          filename;
+  uint16_t        version;
+  uniq<SerialIn>  in;
+  uniq<SerialMap> file;
+  Compression     comp;
+  vec<DataBlock>  blocks;
+  // the packages the lists belong to in the order they are stored, removed
+  // ones are cleared
+  vec<Package*>   packages;
+  std::unordered_map<const Package*, size_t> position;
+  // the lists once the section is opened, and where each one starts
+  bool            opened = false;
+  const char     *lists  = nullptr;
+  vec<char>       buffer;
+  vec<size_t>     offsets;
+
+  void Drop(const Package *pkg) {
+    auto entry = position.find(pkg);
+    if (entry == position.end())
+      return;
+    packages[entry->second] = nullptr;
+    position.erase(entry);
+  }
+
+  // the stored list of a package, false for packages which are not stored
+  // or when the section is not open
+  bool Stored(const Package *pkg, const char *&data, size_t &size) const {
+    auto entry = position.find(pkg);
+    if (!opened || entry == position.end())
+      return false;
+    data = lists + offsets[entry->second];
+    size = offsets[entry->second + 1] - offsets[entry->second];
+    return true;
+  }
+};
+
+static bool open_filelist_data(DB *db);
+
+// Everything following the string table. Block boundaries for compression
+// are after the package count, after every db_block_size bytes of packages,
+// after the tail and every db_block_size bytes of the file lists.
+static bool write_data(DB *db, SerialOut &data, const Header &hdr,
+                       vec<DataBlock> &blocks, size_t &filelist_blocks)
+{
+  size_t   block_at   = data.out_.TellP(),
+           objects_at = 0;
+  uint32_t packages   = 0;
+  auto end_block = [&]() {
+    size_t at = data.out_.TellP();
+    blocks.push_back({ at - block_at, 0, packages,
+                       uint32_t(data.objref_.size() - objects_at) });
+    block_at   = at;
+    objects_at = data.objref_.size();
+    packages   = 0;
+  };
+
+  data <= db->name_;
+  if (!write_stringlist(data, db->library_path_))
     return false;
 
-  out <= (uint32_t)db->packages_.size();
+  write_count(data, db->packages_.size());
+  end_block();
+
   for (auto &pkg : db->packages_) {
-    if (!write_pkg(out, pkg, hdr.version, hdr.flags))
+    if (!write_pkg(data, pkg, hdr.version, hdr.flags))
       return false;
+    ++packages;
+    if (data.out_.TellP() - block_at >= db_block_size)
+      end_block();
   }
+  if (packages)
+    end_block();
 
   uint32_t cnt_found = 0,
            cnt_missing = 0;
   {
-    out <= (uint32_t)db->objects_.size();
+    write_count(data, db->objects_.size());
     for (auto &obj : db->objects_) {
-      if (!write_obj(out, obj))
+      if (!write_obj(data, obj))
         return false;
       if (!obj->req_found_.empty())
         ++cnt_found;
@@ -644,72 +1756,292 @@ static bool db_store(DB *db, const string& filename) {
     }
   }
 
-  out <= cnt_found;
+  write_count(data, cnt_found);
   for (Elf *obj : db->objects_) {
     if (obj->req_found_.empty())
       continue;
-    if (!write_obj(out, obj))
+    if (!write_obj(data, obj))
       return false;
-    if (!write_objset(out, obj->req_found_))
+    if (!write_objset(data, obj->req_found_))
       return false;
   }
-  out <= cnt_missing;
+  write_count(data, cnt_missing);
   for (Elf *obj : db->objects_) {
     if (obj->req_missing_.empty())
       continue;
-    if (!write_obj(out, obj))
+    if (!write_obj(data, obj))
       return false;
-    if (!write_stringset(out, obj->req_missing_))
+    if (!write_stringset(data, obj->req_missing_))
       return false;
   }
 
   if (hdr.flags & DBFlags::IgnoreRules) {
-    if (!write_stringset(out, db->ignore_file_rules_))
+    if (!write_stringset(data, db->ignore_file_rules_))
       return false;
   }
   if (hdr.flags & DBFlags::AssumeFound) {
-    if (!write_stringset(out, db->assume_found_rules_))
+    if (!write_stringset(data, db->assume_found_rules_))
       return false;
   }
 
   if (hdr.flags & DBFlags::PackageLDPath) {
-    out <= (uint32_t)db->package_library_path_.size();
+    write_count(data, db->package_library_path_.size());
     for (auto iter : db->package_library_path_) {
-      out <= iter.first;
-      if (!write_stringlist(out, iter.second))
+      data <= iter.first;
+      if (!write_stringlist(data, iter.second))
         return false;
     }
   }
 
   if (hdr.flags & DBFlags::BasePackages) {
-    if (!write_stringset(out, db->base_packages_))
+    if (!write_stringset(data, db->base_packages_))
       return false;
   }
 
-  return out.out_;
-}
-
-static bool db_read(DB *db, const string& filename) {
-  bool gzip = ends_with_gz(filename);
-  uniq<SerialIn> sin(SerialIn::Open(db, filename, gzip));
-
-  if (gzip)
-    db->config_.Log(Message, "reading compressed database\n");
-  else
-    db->config_.Log(Message, "reading database\n");
+  // sections are preceded by their size, which is counted first
+  uniq<SerialOut> scount(SerialOut::Count(db));
+  SerialOut &count(*scount);
+  count.version_ = hdr.version;
 
-  SerialIn &in(*sin);
-  if (!sin || !in.in_) {
-    //log(Error, "failed to open file %s for reading\n", filename.c_str());
-    return true; // might not exist...
+  if (hdr.flags & DBFlags::Indices) {
+    if (!write_indices(count, data))
+      return false;
+    write_count(data, count.out_.TellP());
+    if (!write_indices(data, data))
+      return false;
   }
 
-  Header hdr;
-  in >= hdr;
-  if (memcmp(hdr.magic, depdb_magic, sizeof(hdr.magic)) != 0) {
-    db->config_.Log(Error,
-                    "not a valid database file: %s\n", filename.c_str());
-    return false;
+  end_block();
+
+  // The file lists follow in a section which is only read when needed, in
+  // blocks of their own when compressed. It starts with the size of every
+  // package's list.
+  if (hdr.flags & DBFlags::FileLists) {
+    // the lists which were never loaded are copied from the old file
+    const FilelistSource *source = db->filelists_source_.get();
+    const char *stored;
+    size_t      size;
+    write_count(data, db->packages_.size());
+    for (auto &pkg : db->packages_) {
+      if (source && source->Stored(pkg, stored, size)) {
+        write_count(data, size);
+        continue;
+      }
+      size_t at = count.out_.TellP();
+      if (!write_stringlist(count, pkg->filelist_))
+        return false;
+      write_count(data, count.out_.TellP() - at);
+    }
+    for (auto &pkg : db->packages_) {
+      if (source && source->Stored(pkg, stored, size)) {
+        if (data.out_.Write(stored, size) != ssize_t(size))
+          return false;
+      }
+      else if (!write_stringlist(data, pkg->filelist_))
+        return false;
+    }
+    for (size_t end = data.out_.TellP(); block_at != end; ++filelist_blocks) {
+      size_t size = std::min(db_block_size, end - block_at);
+      blocks.push_back({ size, 0, 0, 0 });
+      block_at += size;
+    }
+  }
+  return data.out_;
+}
+
+// The database is written to a file of its own which replaces the old one
+// once it is complete: a failed write leaves the old one intact, and it
+// stays readable while the new one is written.
+static string store_target(const string& filename) {
+  // replace the file a symlink points to rather than the symlink
+  char *path = ::realpath(filename.c_str(), nullptr);
+  if (!path)
+    return filename;
+  string target(path);
+  ::free(path);
+  return target;
+}
+
+static bool db_store(DB *db, const string& filename) {
+  Compression comp = file_compression(filename);
+  if (!compression_supported(comp, db->config_))
+    return false;
+  unsigned level = compression_level(comp, db->config_);
+  // the file lists may still have to come from the file being replaced
+  if (!open_filelist_data(db))
+    return false;
+
+  Header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+
+  memcpy(hdr.magic, depdb_magic, sizeof(hdr.magic));
+  hdr.version = 1;
+
+  // flags:
+  if (db->ignore_file_rules_.size())
+    hdr.flags |= DBFlags::IgnoreRules;
+  if (db->package_library_path_.size())
+    hdr.flags |= DBFlags::PackageLDPath;
+  if (db->base_packages_.size())
+    hdr.flags |= DBFlags::BasePackages;
+  if (db->strict_linking_)
+    hdr.flags |= DBFlags::StrictLinking;
+  if (db->assume_found_rules_.size())
+    hdr.flags |= DBFlags::AssumeFound;
+  if (db->contains_filelists_)
+    hdr.flags |= DBFlags::FileLists;
+  // the stored search paths have to be up to date
+  if (db->search_paths_valid_)
+    hdr.flags |= DBFlags::Indices;
+
+  // Figure out which database format version this will be
+  if (hdr.flags & DBFlags::FileLists)
+    hdr.version = 7;
+  else if (hdr.flags & DBFlags::AssumeFound)
+    hdr.version = 6;
+  else if (db->contains_groups_)
+    hdr.version = 5;
+  else if (db->contains_package_depends_)
+    hdr.version = 4;
+  else if (hdr.flags)
+      hdr.version = 2;
+
+  // okay
+
+  // ver8 introduces faster refs...
+  if (hdr.version < 8)
+    hdr.version = 8;
+
+  // ver9 contains interpreter data
+  if (hdr.version < 9)
+    hdr.version = 9;
+
+  // ver10 refers to a string table preceding the data, moves the file
+  // lists behind everything else, can store the lookup indices and stores
+  // objects sharing their info as aliases
+  if (hdr.version < 10)
+    hdr.version = 10;
+
+  // the strings are numbered by a first pass over the data which is only
+  // counted, so the string table can precede the data it is used in
+  uniq<SerialOut> sstrings(SerialOut::Count(db));
+  SerialOut &strings(*sstrings);
+  strings.version_ = hdr.version;
+  vec<DataBlock> blocks;
+  size_t filelist_blocks = 0;
+  if (!write_data(db, strings, hdr, blocks, filelist_blocks))
+    return false;
+
+  // Compressed databases start with the block index, whose compressed
+  // sizes are filled in once the blocks are written. The first block
+  // starts with the header and the string table.
+  vec<char> frame;
+  bool has_index = false;
+  if (comp != Compression::None) {
+    uniq<SerialOut> shead(SerialOut::Count(db));
+    SerialOut &head(*shead);
+    head.version_ = hdr.version;
+    head <= hdr;
+    if (!write_strtab(head, strings))
+      return false;
+    blocks[0].size += head.out_.TellP();
+    for (auto &b : blocks) {
+      if (b.size > db_block_max) {
+        db->config_.Log(Error, "db error: a block of %zu bytes is too large "
+                               "to be compressed\n", b.size);
+        return false;
+      }
+    }
+    has_index = block_index_frame(db, comp, hdr.version, blocks,
+                                  filelist_blocks, frame);
+  }
+
+  // nothing is opened until the data is known to fit
+  string target = store_target(filename);
+  string temp   = target + ".tmp" + std::to_string(::getpid());
+  uniq<SerialOut> sout(SerialOut::Open(db, temp));
+  guard remove_temp([&]() {
+    sout.reset();
+    ::unlink(temp.c_str());
+  });
+
+  if (comp != Compression::None)
+    db->config_.Log(Message, "writing compressed database\n");
+  else
+    db->config_.Log(Message, "writing database\n");
+
+  if (!sout || !sout->out_) {
+    db->config_.Log(Error, "failed to open file %s for writing\n",
+                    temp.c_str());
+    return false;
+  }
+  SerialOut &out(*sout);
+  out.version_ = hdr.version;
+
+  // compressed blocks are written one by one
+  uniq<SerialOut> sdata;
+  if (comp != Compression::None) {
+    if (has_index)
+      out.out_.Write(frame.data(), frame.size());
+    sdata.reset(SerialOut::Wrap(db, new SerialBlocks(out.out_, comp, level,
+                                                     blocks, db->config_)));
+  }
+  SerialOut &data(sdata ? *sdata : out);
+  data.version_ = hdr.version;
+  data <= hdr;
+  if (!write_strtab(data, strings))
+    return false;
+
+  data.strref_ = move(strings.strref_);
+  data.strtab_ = move(strings.strtab_);
+  size_t strcount = data.strtab_.size();
+  vec<DataBlock> written;
+  size_t         written_lists = 0;
+  if (!write_data(db, data, hdr, written, written_lists))
+    return false;
+  if (data.strtab_.size() != strcount) {
+    db->config_.Log(Error, "db error: strings changed while writing\n");
+    return false;
+  }
+  if (!data.out_.Flush() || !data.out_)
+    return false;
+
+  if (has_index) {
+    if (!block_index_frame(db, comp, hdr.version, blocks, filelist_blocks,
+                           frame) ||
+        !out.out_.Rewrite(0, frame.data(), frame.size()))
+    {
+      return false;
+    }
+  }
+  if (!out.out_.Flush() || !out.out_)
+    return false;
+  sdata.reset();
+  sout.reset();
+
+  // the new file keeps the permissions of the one it replaces
+  struct stat st;
+  if (::stat(target.c_str(), &st) == 0)
+    ::chmod(temp.c_str(), st.st_mode & 07777);
+  if (::rename(temp.c_str(), target.c_str()) != 0) {
+    db->config_.Log(Error, "failed to replace %s: %s\n", target.c_str(),
+                    ::strerror(errno));
+    return false;
+  }
+  remove_temp.release();
+  return true;
+}
+
+
+// the header and everything up to the package count
+static bool read_head(DB *db, SerialIn &in, const string& filename,
+                      Header &hdr, uint32_t &len)
+{
+  in >= hdr;
+  if (memcmp(hdr.magic, depdb_magic, sizeof(hdr.magic)) != 0) {
+    db->config_.Log(Error,
+                    "not a valid database file: %s\n", filename.c_str());
+    return false;
   }
   in.version_ = hdr.version;
 
@@ -734,29 +2066,52 @@ static bool db_read(DB *db, const string& filename) {
   if (hdr.flags & DBFlags::FileLists)
     db->contains_filelists_ = true;
 
+  if (hdr.version >= 10 && !read_strtab(in)) {
+    db->config_.Log(Error, "failed reading string table\n");
+    return false;
+  }
+
   in >= db->name_;
   if (!read_stringlist(in, db->library_path_)) {
     db->config_.Log(Error, "failed reading library paths\n");
     return false;
   }
 
-  uint32_t len;
+  if (!read_count(in, len)) {
+    db->config_.Log(Error, "failed reading packages\n");
+    return false;
+  }
+  return true;
+}
 
-  in >= len;
-  db->packages_.resize(len);
-  for (uint32_t i = 0; i != len; ++i) {
-    if (!read_pkg(in, db->packages_[i], hdr.version, hdr.flags, db->config_)) {
-      db->config_.Log(Error, "failed reading packages\n");
+// moves forward to a position of the uncompressed data
+static bool skip_to(SerialStream &in, size_t at) {
+  if (in.TellG() > at)
+    return false;
+  if (in.Direct(at - in.TellG()))
+    return true;
+  char skip[64 * 1024];
+  while (in.TellG() != at) {
+    size_t bytes = std::min(sizeof(skip), at - in.TellG());
+    if (in.Read(skip, bytes) != ssize_t(bytes))
       return false;
-    }
   }
+  return true;
+}
+
+// everything after the packages
+static bool read_tail(DB *db, SerialIn &in, const Header &hdr) {
+  uint32_t len;
 
   if (!read_objlist(in, db->objects_, db->config_)) {
     db->config_.Log(Error, "failed reading object list\n");
     return false;
   }
 
-  in >= len;
+  if (!read_count(in, len)) {
+    db->config_.Log(Error, "failed reading map of found dependencies\n");
+    return false;
+  }
   rptr<Elf> obj;
   for (uint32_t i = 0; i != len; ++i) {
     if (!read_obj(in, obj, db->config_) ||
@@ -767,7 +2122,10 @@ static bool db_read(DB *db, const string& filename) {
     }
   }
 
-  in >= len;
+  if (!read_count(in, len)) {
+    db->config_.Log(Error, "failed reading map of missing dependencies\n");
+    return false;
+  }
   for (uint32_t i = 0; i != len; ++i) {
     if (!read_obj(in, obj, db->config_) ||
         !read_stringset(in, obj->req_missing_))
@@ -790,7 +2148,8 @@ static bool db_read(DB *db, const string& filename) {
   }
 
   if (hdr.flags & DBFlags::PackageLDPath) {
-    in >= len;
+    if (!read_count(in, len))
+      return false;
     for (uint32_t i = 0; i != len; ++i) {
       string pkg;
       in >= pkg;
@@ -804,9 +2163,468 @@ static bool db_read(DB *db, const string& filename) {
       return false;
   }
 
+  if (hdr.flags & DBFlags::Indices) {
+    if (!read_count(in, len))
+      return false;
+    size_t end = in.in_.TellG() + len;
+    if (!read_indices(in) || in.in_.TellG() != end) {
+      db->config_.Log(Debug, "stored indices are stale, rebuilding them\n");
+      db->dir_ids_.clear();
+      db->soname_index_.clear();
+      db->package_index_.clear();
+      db->provide_index_.clear();
+      db->replace_index_.clear();
+      db->search_paths_valid_ = false;
+      if (!skip_to(in.in_, end))
+        return false;
+    }
+  }
+
+  if (in.bad_strref_) {
+    db->config_.Log(Error, "db error: string id out of range\n");
+    return false;
+  }
+  if (in.bad_string_) {
+    db->config_.Log(Error, "db error: invalid string length\n");
+    return false;
+  }
+
   return true;
 }
 
+static FilelistSource* defer_filelists(DB *db, const string& filename,
+                                       const Header &hdr)
+{
+  if (hdr.version < 10 || !(hdr.flags & DBFlags::FileLists))
+    return nullptr;
+  auto source = std::make_shared<FilelistSource>();
+  source->filename = filename;
+  source->version  = hdr.version;
+  source->packages = db->packages_;
+  for (size_t i = 0; i != source->packages.size(); ++i)
+    source->position.emplace(source->packages[i], i);
+  db->filelists_source_ = source;
+  return source.get();
+}
+
+
+
+// out has to have room for exactly the uncompressed size
+static bool decompress_block(Compression comp, const char *data,
+                             size_t csize, char *out, size_t size)
+{
+  switch (comp) {
+    case Compression::GZip: {
+      z_stream z;
+      memset(&z, 0, sizeof(z));
+      if (inflateInit2(&z, 15+16) != Z_OK)
+        return false;
+      z.next_in   = (Bytef*)data;
+      z.avail_in  = uInt(csize);
+      z.next_out  = (Bytef*)out;
+      z.avail_out = uInt(size);
+      bool ok = inflate(&z, Z_FINISH) == Z_STREAM_END &&
+                z.total_out == size;
+      inflateEnd(&z);
+      return ok;
+    }
+#ifdef PKGDEPDB_ENABLE_ZSTD
+    case Compression::Zstd: {
+      size_t r = ZSTD_decompress(out, size, data, csize);
+      return !ZSTD_isError(r) && r == size;
+    }
+#endif
+#ifdef PKGDEPDB_ENABLE_LZ4
+    case Compression::LZ4: {
+      LZ4F_dctx *dctx;
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return false;
+      size_t outsize = size,
+             insize  = csize;
+      size_t r = LZ4F_decompress(dctx, out, &outsize, data, &insize,
+                                 nullptr);
+      LZ4F_freeDecompressionContext(dctx);
+      return r == 0 && outsize == size;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+#ifdef PKGDEPDB_ENABLE_THREADS
+static inline uint32_t get_le(const char *data, size_t bytes) {
+  uint32_t value = 0;
+  for (size_t i = 0; i != bytes; ++i)
+    value |= uint32_t(uint8_t(data[i])) << (8*i);
+  return value;
+}
+
+// finds the index written by wrap_block_index, false for files without one
+static bool read_block_index(DB *db, const SerialMap &file, Compression comp,
+                             vec<DataBlock> &blocks, size_t &filelist_blocks)
+{
+  const char *data = file.data_;
+  size_t      size = file.size_;
+  const char *index;
+  size_t      len;
+  if (comp == Compression::GZip) {
+    if (size < 16 || memcmp(data, "\x1f\x8b\x08", 3) != 0 || !(data[3] & 4))
+      return false;
+    size_t xlen = get_le(data + 10, 2);
+    if (xlen < 4 || 12 + xlen > size || data[12] != 'P' || data[13] != 'D')
+      return false;
+    len   = get_le(data + 14, 2);
+    index = data + 16;
+    if (len + 4 > xlen)
+      return false;
+  }
+  else {
+    if (size < 8 || get_le(data, 4) != skippable_frame_magic)
+      return false;
+    len   = get_le(data + 4, 4);
+    index = data + 8;
+    if (len > size - 8)
+      return false;
+  }
+  if (len < sizeof(block_index_magic) ||
+      memcmp(index, block_index_magic, sizeof(block_index_magic)) != 0)
+  {
+    return false;
+  }
+
+  index += sizeof(block_index_magic);
+  len   -= sizeof(block_index_magic);
+  uniq<SerialIn> sin(SerialIn::Buffer(db, vec<char>(index, index + len)));
+  SerialIn &in(*sin);
+  in.version_ = DB::CURRENT;
+
+  uint32_t count;
+  if (!read_count(in, count) || count < 2)
+    return false;
+  blocks.resize(count);
+  size_t total = 0;
+  for (uint32_t i = 0; i != count; ++i) {
+    uint32_t bsize, csize, packages, objects;
+    if (!read_count(in, bsize)    || !read_count(in, csize) ||
+        !read_count(in, packages) || !read_count(in, objects))
+    {
+      return false;
+    }
+    if (bsize > db_block_max)
+      return false;
+    blocks[i] = { bsize, csize, packages, objects };
+    total += csize;
+  }
+  uint32_t lists;
+  if (!read_count(in, lists) || lists > count - 2)
+    return false;
+  filelist_blocks = lists;
+  // only the blocks between the first one and the tail contain packages
+  size_t last = count - 1 - lists;
+  for (size_t i = 0; i != count; ++i) {
+    if ((i == 0 || i >= last) != (blocks[i].packages == 0))
+      return false;
+  }
+  return total <= size;
+}
+
+// decompresses and reads the package blocks on multiple threads and joins
+// their package and object references for the rest of the database
+static bool db_read_blocks(DB *db, const string& filename,
+                           uniq<SerialMap> file, Compression comp,
+                           const vec<DataBlock> &blocks,
+                           size_t filelist_blocks)
+{
+  const Config &config(db->config_);
+
+  // the blocks make up the end of the file
+  vec<const char*> data(blocks.size());
+  const char *at = file->data_ + file->size_;
+  for (size_t i = blocks.size(); i--; ) {
+    at -= blocks[i].csize;
+    data[i] = at;
+  }
+
+  auto open_block = [&](size_t i) -> SerialIn* {
+    vec<char> bytes(blocks[i].size);
+    if (!decompress_block(comp, data[i], blocks[i].csize,
+                          bytes.data(), bytes.size()))
+      return nullptr;
+    return SerialIn::Buffer(db, move(bytes));
+  };
+
+  uniq<SerialIn> shead(open_block(0));
+  if (!shead) {
+    config.Log(Error, "failed to decompress database\n");
+    return false;
+  }
+  SerialIn &head(*shead);
+  Header   hdr;
+  uint32_t len;
+  if (!read_head(db, head, filename, hdr, len))
+    return false;
+
+  size_t first = 1,
+         last  = blocks.size() - 1 - filelist_blocks,
+         total = 0;
+  for (size_t i = first; i != last; ++i)
+    total += blocks[i].packages;
+  if (total != len) {
+    config.Log(Error, "db error: block index does not match the package "
+                      "count\n");
+    return false;
+  }
+
+  vec<uniq<SerialIn>> readers(blocks.size());
+  vec<char>           good(blocks.size(), 0);
+  each_block(last - first, [&](size_t b) {
+    size_t i = first + b;
+    readers[i].reset(open_block(i));
+    if (!readers[i])
+      return;
+    SerialIn &in(*readers[i]);
+    in.version_   = hdr.version;
+    in.ver8_refs_ = true;
+    in.strtab_    = head.strtab_;
+    for (uint32_t p = 0; p != blocks[i].packages; ++p) {
+      Package *pkg;
+      if (!read_pkg(in, pkg, hdr.version, hdr.flags, config))
+        return;
+    }
+    good[i] = in.objref_.size() == blocks[i].objects &&
+              !in.bad_strref_ && !in.bad_string_;
+  }, config);
+
+  // the database takes the packages even when a block failed to be read,
+  // so they are freed with it
+  vec<Elf*> objref;
+  bool      ok = true;
+  for (size_t i = first; i != last; ++i) {
+    if (!readers[i]) {
+      ok = false;
+      continue;
+    }
+    SerialIn &in(*readers[i]);
+    db->packages_.insert(db->packages_.end(),
+                         in.pkgref_.begin(), in.pkgref_.end());
+    objref.insert(objref.end(), in.objref_.begin(), in.objref_.end());
+    ok = ok && good[i];
+  }
+  if (!ok) {
+    config.Log(Error, "failed reading packages\n");
+    return false;
+  }
+
+  uniq<SerialIn> stail(open_block(last));
+  if (!stail) {
+    config.Log(Error, "failed to decompress database\n");
+    return false;
+  }
+  SerialIn &tail(*stail);
+  tail.version_   = hdr.version;
+  tail.ver8_refs_ = true;
+  tail.strtab_    = head.strtab_;
+  tail.pkgref_    = db->packages_;
+  tail.objref_    = move(objref);
+  if (!read_tail(db, tail, hdr))
+    return false;
+
+  if (FilelistSource *source = defer_filelists(db, filename, hdr)) {
+    if (filelist_blocks) {
+      source->file = move(file);
+      source->comp = comp;
+      source->blocks.assign(blocks.end() - filelist_blocks, blocks.end());
+    } else {
+      tail.objref_.clear();
+      tail.pkgref_.clear();
+      source->in = move(stail);
+    }
+  }
+  return true;
+}
+#endif
+
+static bool db_read(DB *db, const string& filename) {
+  Compression comp = file_compression(filename);
+  if (!compression_supported(comp, db->config_))
+    return false;
+
+  if (comp != Compression::None)
+    db->config_.Log(Message, "reading compressed database\n");
+  else
+    db->config_.Log(Message, "reading database\n");
+
+#ifdef PKGDEPDB_ENABLE_THREADS
+  if (comp != Compression::None && thread::threadcount(db->config_) > 1) {
+    uniq<SerialMap> file(new SerialMap(filename));
+    vec<DataBlock>  blocks;
+    size_t          filelist_blocks;
+    if (*file && read_block_index(db, *file, comp, blocks, filelist_blocks)) {
+      db->config_.Log(Debug, "reading %zu blocks\n", blocks.size());
+      return db_read_blocks(db, filename, move(file), comp, blocks,
+                            filelist_blocks);
+    }
+  }
+#endif
+
+  uniq<SerialIn> sin(SerialIn::Open(db, filename, comp));
+  SerialIn &in(*sin);
+  if (!sin || !in.in_) {
+    //log(Error, "failed to open file %s for reading\n", filename.c_str());
+    return true; // might not exist...
+  }
+
+  Header   hdr;
+  uint32_t len;
+  if (!read_head(db, in, filename, hdr, len))
+    return false;
+
+  db->packages_.resize(len);
+  for (uint32_t i = 0; i != len; ++i) {
+    if (!read_pkg(in, db->packages_[i], hdr.version, hdr.flags, db->config_)) {
+      db->config_.Log(Error, "failed reading packages\n");
+      return false;
+    }
+  }
+
+  if (!read_tail(db, in, hdr))
+    return false;
+  if (FilelistSource *source = defer_filelists(db, filename, hdr)) {
+    in.objref_.clear();
+    in.pkgref_.clear();
+    source->in = move(sin);
+  }
+  return true;
+}
+
+
+// Opens the file list section of a database: decompresses the blocks
+// holding it or continues the stream which stopped where it starts.
+static SerialIn* open_filelists(DB *db, FilelistSource &source) {
+  if (source.in)
+    return source.in.release();
+
+  auto  &blocks = source.blocks;
+  size_t count  = blocks.size();
+
+  // the blocks make up the end of the file
+  vec<const char*> data(count);
+  vec<size_t>      offsets(count + 1, 0);
+  const char      *end = source.file->data_ + source.file->size_;
+  for (size_t i = count; i--; ) {
+    end -= blocks[i].csize;
+    data[i] = end;
+  }
+  for (size_t i = 0; i != count; ++i)
+    offsets[i+1] = offsets[i] + blocks[i].size;
+
+  vec<char> bytes(offsets[count]);
+  vec<char> good(count, 0);
+  each_block(count, [&](size_t i) {
+    good[i] = decompress_block(source.comp, data[i], blocks[i].csize,
+                               bytes.data() + offsets[i], blocks[i].size);
+  }, db->config_);
+  if (std::find(good.begin(), good.end(), 0) != good.end())
+    return nullptr;
+  SerialIn *in = SerialIn::Buffer(db, move(bytes));
+  in->version_ = source.version;
+  return in;
+}
+
+// The section holds the package count, the size of each package's list,
+// then the lists, which are kept as they are.
+static bool index_filelists(SerialIn &in, FilelistSource &source) {
+  uint32_t count;
+  if (!read_count(in, count) || count != source.packages.size())
+    return false;
+  auto &offsets = source.offsets;
+  offsets.assign(count + 1, 0);
+  for (uint32_t i = 0; i != count; ++i) {
+    uint32_t size;
+    if (!read_count(in, size))
+      return false;
+    offsets[i+1] = offsets[i] + size;
+  }
+
+  source.lists = in.in_.Direct(offsets[count]);
+  if (!source.lists) {
+    source.buffer.resize(offsets[count]);
+    if (in.in_.Read(source.buffer.data(), source.buffer.size()) !=
+        ssize_t(source.buffer.size()))
+    {
+      return false;
+    }
+    source.lists = source.buffer.data();
+  }
+  return true;
+}
+
+// the lists cannot be read, the database must not be stored without them
+static bool filelists_failed(DB *db) {
+  db->config_.Log(Error, "failed reading file lists from %s\n",
+                  db->filelists_source_->filename.c_str());
+  for (auto &pkg : db->packages_)
+    pkg->filelist_.clear();
+  db->filelists_failed_ = true;
+  db->filelists_source_.reset();
+  return false;
+}
+
+// gets hold of the stored lists without parsing them
+static bool open_filelist_data(DB *db) {
+  if (db->filelists_failed_)
+    return false;
+  FilelistSource *source = db->filelists_source_.get();
+  if (!source || source->opened)
+    return true;
+
+  uniq<SerialIn> sin(open_filelists(db, *source));
+  if (!sin || !index_filelists(*sin, *source))
+    return filelists_failed(db);
+  // the stream or buffer the lists may point into
+  source->in     = move(sin);
+  source->opened = true;
+  return true;
+}
+
+// Parses the lists of the packages still in the database, in parts of
+// about a block's size, each on its own.
+static bool read_filelists(DB *db, const FilelistSource &source) {
+  auto  &offsets = source.offsets;
+  size_t count   = source.packages.size();
+
+  // the package each part starts with
+  vec<size_t> parts { 0 };
+  for (size_t i = 0; i != count; ++i) {
+    if (i+1 == count || offsets[i+1] - offsets[parts.back()] >= db_block_size)
+      parts.push_back(i+1);
+  }
+  vec<char> good(parts.size() - 1, 0);
+  each_block(parts.size() - 1, [&](size_t p) {
+    size_t from = parts[p],
+           to   = parts[p+1];
+    uniq<SerialIn> spart(SerialIn::Buffer(db,
+      vec<char>(source.lists + offsets[from], source.lists + offsets[to])));
+    SerialIn &part(*spart);
+    part.version_ = source.version;
+    for (size_t i = from; i != to; ++i) {
+      size_t   end = offsets[i+1] - offsets[from];
+      Package *pkg = source.packages[i];
+      // the lists of removed packages are skipped
+      if (pkg ? !read_stringlist(part, pkg->filelist_)
+              : !part.in_.Direct(end - part.in_.TellG()))
+      {
+        return;
+      }
+      if (part.in_.TellG() != end)
+        return;
+    }
+    good[p] = !part.bad_string_;
+  }, db->config_);
+  return std::find(good.begin(), good.end(), 0) == good.end();
+}
+
 
 // There we go:
 
@@ -819,7 +2637,33 @@ bool DB::Read(const string& filename) {
     config_.Log(Error, "internal usage error: DB::read on a non-empty db!\n");
     return false;
   }
-  return db_read(this, filename);
+  if (!db_read(this, filename))
+    return false;
+  // adopting the stored indices left the search paths valid
+  if (search_paths_valid_)
+    RebuildLinks();
+  else
+    RebuildIndices();
+  return true;
+}
+
+bool DB::LoadFilelists() {
+  if (!open_filelist_data(this))
+    return false;
+  if (!filelists_source_)
+    return true;
+
+  config_.Log(Debug, "reading file lists\n");
+  if (!read_filelists(this, *filelists_source_))
+    return filelists_failed(this);
+  // the database file is closed once they are read
+  filelists_source_.reset();
+  return true;
+}
+
+void DB::DropFilelist(const Package *pkg) {
+  if (filelists_source_)
+    filelists_source_->Drop(pkg);
 }
 
 } // ::pkgdepdb
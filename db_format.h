@@ -8,6 +8,20 @@ using ObjOutMap = std::map<Elf*,     size_t>;
 using PkgInMap  = std::map<size_t,   Package*>;
 using ObjInMap  = std::map<size_t,   Elf*>;
 
+class SerialBuffer;
+
+// objects which can share their info: same class and equal info
+struct ObjInfoHash {
+  size_t operator()(const Elf *obj) const;
+};
+struct ObjInfoEqual {
+  bool operator()(const Elf *a, const Elf *b) const;
+};
+
+enum class Compression {
+  None, GZip, Zstd, LZ4
+};
+
 class SerialStream {
  public:
   virtual ~SerialStream() {}
@@ -15,6 +29,15 @@ class SerialStream {
   virtual ssize_t Read (void *buf,       size_t bytes) = 0;
   virtual size_t  TellP() const = 0;
   virtual size_t  TellG() const = 0;
+  // writes out what is still buffered
+  virtual bool    Flush() = 0;
+  // the next bytes in place, for streams which have them in memory anyway
+  virtual const char* Direct(size_t bytes) { (void)bytes; return nullptr; }
+  // overwrites bytes written earlier, for streams which can
+  virtual bool    Rewrite(size_t at, const void *buf, size_t bytes) {
+    (void)at; (void)buf; (void)bytes;
+    return false;
+  }
 
   virtual operator bool() const = 0;
 
@@ -36,12 +59,20 @@ class SerialIn {
   // whether objref and pkgref are used
   bool                          ver8_refs_ = false;
   uint16_t                      version_ = 0;
+  // v10: the string table, shared by the readers of a database's blocks,
+  // and whether a reference into it was invalid
+  std::shared_ptr<vec<istring>> strtab_;
+  bool                          bad_strref_ = false;
+  // a string's length could not be read
+  bool                          bad_string_ = false;
 
  private:
   SerialIn(DB*, SerialStream*);
 
  public:
-  static SerialIn* Open(DB *db, const string& file, bool gz);
+  static SerialIn* Open(DB *db, const string& file, Compression);
+  // reads data which is already in memory
+  static SerialIn* Buffer(DB *db, vec<char> &&data);
 };
 
 class SerialOut {
@@ -56,13 +87,33 @@ class SerialOut {
   bool GetObjRef(const Elf*,     size_t *out);
   bool GetPkgRef(const Package*, size_t *out);
 
+  // v10: pooled strings are numbered in the order they are first written
+  std::unordered_map<const string*, uint32_t> strref_;
+  vec<const string*>                          strtab_;
+
+  uint32_t GetStrRef(const istring&);
+
+  // v10: the objects of the package being written by their info, later
+  // ones with the same info are written as aliases of them
+  std::unordered_map<const Elf*, size_t, ObjInfoHash, ObjInfoEqual> inforef_;
+
   uint16_t                      version_ = 0;
 
  private:
+  SerialBuffer                 *buffer_ = nullptr;
+
   SerialOut(DB*, SerialStream*);
 
  public:
-  static SerialOut* Open(DB *db, const string& file, bool gz);
+  // compressed databases are written through Wrap
+  static SerialOut* Open(DB *db, const string& file);
+  // collects the output in memory
+  static SerialOut* Buffer(DB *db);
+  const vec<char>& Buffered() const;
+  // only counts the output, TellP() is its size
+  static SerialOut* Count(DB *db);
+  // writes to a stream of the caller's, taking it over
+  static SerialOut* Wrap(DB *db, SerialStream *out);
 };
 
 template<typename T>
@@ -77,22 +128,123 @@ static inline SerialIn& operator>=(SerialIn &in, T& r) {
   return in;
 }
 
+// LEB128, used by v10 for counts, references and string ids
+static inline void write_varint(SerialOut &out, uint64_t value) {
+  uint8_t buf[10];
+  size_t  len = 0;
+  while (value >= 0x80) {
+    buf[len++] = uint8_t(value) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = uint8_t(value);
+  out.out_.Write(buf, len);
+}
+
+static inline bool read_varint(SerialIn &in, uint64_t &value) {
+  value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    uint8_t byte;
+    if (in.in_.Read(&byte, 1) != 1)
+      return false;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// lengths and counts were 32 bit before v10
+static inline void write_count(SerialOut &out, size_t count) {
+  if (out.version_ >= 10)
+    return write_varint(out, count);
+  auto len = static_cast<uint32_t>(count);
+  out.out_.Write((const char*)&len, sizeof(len));
+}
+
+static inline bool read_count(SerialIn &in, uint32_t &count) {
+  if (in.version_ >= 10) {
+    uint64_t value;
+    if (!read_varint(in, value) || value > UINT32_MAX)
+      return false;
+    count = uint32_t(value);
+    return true;
+  }
+  return in.in_.Read((char*)&count, sizeof(count)) == sizeof(count);
+}
+
+// object and package references were a size_t before v10
+static inline void write_ref(SerialOut &out, size_t ref) {
+  if (out.version_ >= 10)
+    return write_varint(out, ref);
+  out.out_.Write((const char*)&ref, sizeof(ref));
+}
+
+static inline bool read_ref(SerialIn &in, size_t &ref) {
+  if (in.version_ >= 10) {
+    uint64_t value;
+    if (!read_varint(in, value))
+      return false;
+    ref = size_t(value);
+    return true;
+  }
+  return in.in_.Read((char*)&ref, sizeof(ref)) == sizeof(ref);
+}
+
+// v10 refers to strings by their id in the string table
+static inline const istring* read_strref(SerialIn &in) {
+  uint64_t id;
+  if (!read_varint(in, id) || !in.strtab_ || id >= in.strtab_->size()) {
+    in.bad_strref_ = true;
+    return nullptr;
+  }
+  return &(*in.strtab_)[id];
+}
+
 // special for strings:
 static inline SerialOut& operator<=(SerialOut &out, const string& r) {
-  auto len = static_cast<uint32_t>(r.length());
-  out.out_.Write((const char*)&len, sizeof(len));
-  out.out_.Write(r.c_str(), len);
+  write_count(out, r.length());
+  out.out_.Write(r.c_str(), r.length());
   return out;
 }
 
 static inline SerialIn& operator>=(SerialIn &in, string& r) {
   uint32_t len;
-  in >= len;
+  if (!read_count(in, len)) {
+    in.bad_string_ = true;
+    r.clear();
+    return in;
+  }
+  if (const char *data = in.in_.Direct(len)) {
+    r.assign(data, len);
+    return in;
+  }
   r.resize(len);
   in.in_.Read(&r[0], len);
   return in;
 }
 
+// pooled strings are stored like strings and interned while reading, v10
+// stores each of them once in the string table and refers to it by id
+static inline SerialOut& operator<=(SerialOut &out, const istring& r) {
+  if (out.version_ >= 10) {
+    write_varint(out, out.GetStrRef(r));
+    return out;
+  }
+  return out <= r.str();
+}
+
+static inline SerialIn& operator>=(SerialIn &in, istring& r) {
+  if (in.version_ >= 10) {
+    const istring *s = read_strref(in);
+    r = s ? *s : istring();
+    return in;
+  }
+  string s;
+  in >= s;
+  r = in.db_->strings_->Get(move(s));
+  return in;
+}
+
 bool write_objlist   (SerialOut &out, const ObjectList  &list);
 bool read_objlist    (SerialIn  &in,        ObjectList  &list, const Config&);
 bool write_objset    (SerialOut &out, const ObjectSet   &list);
@@ -101,6 +253,14 @@ bool write_stringlist(SerialOut &out, const vec<string> &list);
 bool read_stringlist (SerialIn  &in,        vec<string> &list);
 bool write_stringset (SerialOut &out, const StringSet   &list);
 bool read_stringset  (SerialIn  &in,        StringSet   &list);
+bool write_stringlist(SerialOut &out, const IStringList &list);
+bool read_stringlist (SerialIn  &in,        IStringList &list);
+bool write_stringset (SerialOut &out, const IStringSet  &list);
+bool read_stringset  (SerialIn  &in,        IStringSet  &list);
+bool write_dependlist(SerialOut &out, const DependList  &list);
+bool read_dependlist (SerialIn  &in,        DependList  &list);
+bool write_strtab    (SerialOut &out, const SerialOut   &strings);
+bool read_strtab     (SerialIn  &in);
 
 } // ::pkgdepdb
 
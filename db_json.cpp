@@ -59,7 +59,7 @@ void DB::ShowPackages_json(bool                filter_broken,
   printf("\n\t\"packages\": [");
 
   const char *mainsep = "\n\t\t";
-  for (auto &pkg : packages_) {
+  for (auto &pkg : FilterCandidates(pkg_filters)) {
     if (!util::all(pkg_filters, *this, *pkg))
       continue;
     if (filter_broken && !IsBroken(pkg))
@@ -264,16 +264,16 @@ void DB::ShowObjects_json(const FilterList    &pkg_filters,
              (unsigned)obj->ei_class_, obj->classString(),
              (unsigned)obj->ei_data_,  obj->dataString(),
              (unsigned)obj->ei_osabi_, obj->osabiString());
-      if (obj->rpath_set_) {
+      if (obj->info_->rpath_set_) {
         printf(",\n\t\t\"rpath\": ");
-        json_quote(stdout, obj->rpath_);
+        json_quote(stdout, obj->info_->rpath_);
       }
-      if (obj->runpath_set_) {
+      if (obj->info_->runpath_set_) {
         printf(",\n\t\t\"runpath\": ");
-        json_quote(stdout, obj->runpath_);
+        json_quote(stdout, obj->info_->runpath_);
       }
       printf(",\n\t\t\"interpreter\": ");
-      json_quote(stdout, obj->interpreter_);
+      json_quote(stdout, obj->info_->interpreter_);
       if (config_.verbosity_ < 2) {
         printf("\n\t}");
         break;
@@ -326,7 +326,7 @@ void DB::ShowFilelist_json(const FilterList    &pkg_filters,
 {
   printf("{ \"filelist\": [");
   const char *mainsep = "\n\t";
-  for (auto &pkg : packages_) {
+  for (auto &pkg : FilterCandidates(pkg_filters)) {
     if (!util::all(pkg_filters, *this, *pkg))
       continue;
     if (!config_.quiet_) {
@@ -384,20 +384,20 @@ static void json_obj(size_t id, FILE *out, const Elf *obj) {
   fprintf(out, ",\n\t\t\t\"ei_class\": %u", (unsigned)obj->ei_class_);
   fprintf(out, ",\n\t\t\t\"ei_data\":  %u", (unsigned)obj->ei_data_);
   fprintf(out, ",\n\t\t\t\"ei_osabi\": %u", (unsigned)obj->ei_osabi_);
-  if (obj->rpath_set_) {
+  if (obj->info_->rpath_set_) {
     fprintf(out, ",\n\t\t\t\"rpath\": ");
-    json_quote(out, obj->rpath_);
+    json_quote(out, obj->info_->rpath_);
   }
-  if (obj->runpath_set_) {
+  if (obj->info_->runpath_set_) {
     fprintf(out, ",\n\t\t\t\"runpath\": ");
-    json_quote(out, obj->runpath_);
+    json_quote(out, obj->info_->runpath_);
   }
   fprintf(out, ",\n\t\t\t\"interpreter\": ");
-  json_quote(out, obj->interpreter_);
-  if (obj->needed_.size()) {
+  json_quote(out, obj->info_->interpreter_);
+  if (obj->info_->needed_.size()) {
     fprintf(out, ",\n\t\t\t\"needed\": [");
     bool comma = false;
-    for (auto &need : obj->needed_) {
+    for (auto &need : obj->info_->needed_) {
       if (comma) fputc(',', out);
       comma = true;
       fprintf(out, "\n\t\t\t\t");
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <elf.h>
 
+#include <algorithm>
+
 #include "main.h"
 #include "pkgdepdb.h"
 #include "endian.h"
@@ -13,39 +16,172 @@ namespace pkgdepdb {
 Elf::Elf()
 : ei_class_   (0),
   ei_osabi_   (0),
-  rpath_set_  (false),
-  runpath_set_(false),
+  info_       (new ElfInfo),
   owner_      (nullptr)
 {}
 
+// copies are aliases of the same file and share its info
 Elf::Elf(const Elf& cp)
 : dirname_    (cp.dirname_),
   basename_   (cp.basename_),
   ei_class_   (cp.ei_class_),
   ei_data_    (cp.ei_data_),
   ei_osabi_   (cp.ei_osabi_),
-  rpath_set_  (cp.rpath_set_),
-  runpath_set_(cp.runpath_set_),
-  rpath_      (cp.rpath_),
-  runpath_    (cp.runpath_),
-  needed_     (cp.needed_),
+  info_       (cp.info_),
   req_found_  (cp.req_found_),
   req_missing_(cp.req_missing_),
   owner_      (cp.owner_)
 {}
 
-template<bool BE,
-         typename HDR, typename SecHDR, typename ProgHDR, typename Dyn>
-Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
-             const Config &optconfig)
+bool ElfInfo::operator==(const ElfInfo &other) const {
+  return rpath_set_       == other.rpath_set_       &&
+         runpath_set_     == other.runpath_set_     &&
+         interpreter_set_ == other.interpreter_set_ &&
+         rpath_           == other.rpath_           &&
+         runpath_         == other.runpath_         &&
+         interpreter_     == other.interpreter_     &&
+         needed_          == other.needed_;
+}
+
+size_t ElfInfo::Hash() const {
+  std::hash<istring> hash;
+  size_t h = hash(rpath_) ^ (hash(runpath_) << 1) ^ (hash(interpreter_) << 2);
+  for (auto &need : needed_)
+    h = h * 31 + hash(need);
+  return h;
+}
+
+// Objects are read front to back in a single pass. Only the byte ranges
+// asked for with Keep() are stored, everything else is read into a small
+// buffer and dropped, so memory use does not depend on the file size.
+class ElfReader {
+ public:
+  ElfReader(const function<Elf::read_func_t> &read, size_t size,
+            const char *name, const Config &optconfig)
+  : read_(read), size_(size), name_(name), optconfig_(optconfig)
+  {}
+
+  size_t Size() const { return size_; }
+
+  // Marks [from, to) to be stored. Parts of it which have already been
+  // passed must have been stored before, otherwise this fails.
+  bool Keep(size_t from, size_t to);
+
+  // Reads up to the offset `to`.
+  bool Advance(size_t to);
+
+  // Returns the stored bytes [off, off+len) or nullptr.
+  const char* Get(size_t off, size_t len) const;
+
+ private:
+  struct Range {
+    size_t    from, to;
+    vec<char> data;
+  };
+
+  const function<Elf::read_func_t> &read_;
+  size_t                            size_;
+  const char                       *name_;
+  const Config                     &optconfig_;
+  size_t                            pos_ = 0;
+  vec<Range>                        ranges_;
+};
+
+bool ElfReader::Keep(size_t from, size_t to) {
+  if (to > size_)
+    to = size_;
+  if (from >= to || Get(from, to-from))
+    return true;
+
+  // merge with all overlapping or adjacent ranges
+  auto first = ranges_.begin();
+  while (first != ranges_.end() && first->to < from)
+    ++first;
+  size_t lo = from, hi = to;
+  auto last = first;
+  for (; last != ranges_.end() && last->from <= to; ++last) {
+    lo = std::min(lo, last->from);
+    hi = std::max(hi, last->to);
+  }
+
+  // whatever lies before the current position must already be stored
+  size_t at = lo;
+  for (auto r = first; r != last && at < pos_; ++r) {
+    if (r->from > at)
+      return false;
+    at = r->to;
+  }
+  if (at < std::min(hi, pos_))
+    return false;
+
+  Range merged { lo, hi, vec<char>(hi - lo) };
+  for (auto r = first; r != last; ++r) {
+    size_t filled = std::min(r->to, pos_);
+    if (filled > r->from)
+      memcpy(&merged.data[r->from - lo], &r->data[0], filled - r->from);
+  }
+  auto where = ranges_.erase(first, last);
+  ranges_.insert(where, move(merged));
+  return true;
+}
+
+bool ElfReader::Advance(size_t to) {
+  if (to > size_)
+    to = size_;
+  char skipbuf[16*1024];
+  auto r = ranges_.begin();
+  while (pos_ < to) {
+    while (r != ranges_.end() && r->to <= pos_)
+      ++r;
+    char   *dest;
+    size_t  len;
+    if (r != ranges_.end() && r->from <= pos_) {
+      dest = &r->data[pos_ - r->from];
+      len  = std::min(r->to, to) - pos_;
+    } else {
+      size_t end = (r != ranges_.end() ? std::min(r->from, to) : to);
+      dest = skipbuf;
+      len  = std::min(sizeof(skipbuf), end - pos_);
+    }
+    ssize_t got = read_(dest, len);
+    if (got < 0) {
+      optconfig_.Log(Error, "failed to read from archive stream\n");
+      return false;
+    }
+    if (!got) {
+      optconfig_.Log(Error, "file was short: %s\n", name_);
+      return false;
+    }
+    pos_ += size_t(got);
+  }
+  return true;
+}
+
+const char* ElfReader::Get(size_t off, size_t len) const {
+  if (off + len > pos_)
+    return nullptr;
+  for (auto &r : ranges_) {
+    if (r.from <= off && off + len <= r.to)
+      return &r.data[off - r.from];
+  }
+  return nullptr;
+}
+
+// how much of the loadable data before the dynamic segment is stored in
+// case .dynstr is in it, objects with a .dynstr beyond that are re-read
+static const size_t dynstr_window = 4 * 1024 * 1024;
+
+template<bool BE, typename HDR, typename ProgHDR, typename Dyn>
+Elf* LoadElf(ElfReader &in, bool *waserror, bool *reread, const char *name,
+             StringPool &strings, const Config &optconfig)
 {
   uniq<Elf> object(new Elf);
 
-  auto checksize =
-    [size,name,&optconfig](ssize_t ioff, size_t sz, const char *msg)
-  -> bool {
-    size_t off = size_t(ioff);
-    if (off + sz > size) {
+  auto size = in.Size();
+  auto checksize = [size,name,&optconfig](size_t off, size_t sz,
+                                          const char *msg) -> bool
+  {
+    if (off > size || sz > size - off) {
       optconfig.Log(Error, "%s: unexpected end of file in ELF file,"
                            " offset %lu (file size %lu): %s\n",
                     name, (unsigned long)(off + sz), (unsigned long)size, msg);
@@ -53,93 +189,110 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
     }
     return true;
   };
+  auto keep = [&in,name,&optconfig,&checksize](size_t off, size_t sz,
+                                               const char *msg) -> bool
+  {
+    if (!checksize(off, sz, msg))
+      return false;
+    if (!in.Keep(off, off + sz)) {
+      optconfig.Log(Error, "%s: %s: data was already skipped\n", name, msg);
+      return false;
+    }
+    return true;
+  };
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wcast-align"
-  HDR  *hdr     = (HDR*)(data);
-  auto  shnum   = Eswap<BE>(hdr->e_shnum);
-  auto  phnum   = Eswap<BE>(hdr->e_phnum);
-  auto  e_shoff = Eswap<BE>(hdr->e_shoff);
-  auto  e_phoff = Eswap<BE>(hdr->e_phoff);
-
-  if (!checksize((ssize_t)e_shoff, sizeof(SecHDR),
-                 "looking for section headers") ||
-      !checksize((ssize_t)e_phoff, sizeof(ProgHDR),
-                 "looking for program headers"))
-  {
+  if (!checksize(0, sizeof(HDR), "ELF header"))
     return 0;
-  }
+  auto   hdr     = reinterpret_cast<const HDR*>(in.Get(0, sizeof(HDR)));
+  size_t phnum   = Eswap<BE>(hdr->e_phnum);
+  size_t e_phoff = Eswap<BE>(hdr->e_phoff);
 
-  auto prog_start = reinterpret_cast<const ProgHDR*>(data + e_phoff);
   // TODO: check auxiliary data when phnum == PX_XNUM
-  if (phnum == PN_XNUM)
-    optconfig.Log(Error, "%s: TODO: program header count too large, skipping",
-                  name);
-  else {
-    if (!checksize((char*)(prog_start + phnum-1) - data, sizeof(*prog_start),
-                   "program header array"))
-    {
-      return 0;
-    }
-    auto ph = prog_start;
-    for (; ph != prog_start + phnum; ++ph) {
-      if (Eswap<BE>(ph->p_type) == PT_INTERP)
-        break;
-    }
-    if (ph != prog_start + phnum) {
-      // this one has an interpreter request
-      object->interpreter_set_ = true;
-      object->interpreter_ = data + Eswap<BE>(ph->p_offset);
-    }
+  if (phnum == PN_XNUM) {
+    optconfig.Log(Error, "%s: TODO: program header count too large\n", name);
+    return 0;
+  }
+  if (phnum && Eswap<BE>(hdr->e_phentsize) != sizeof(ProgHDR)) {
+    optconfig.Log(Error, "%s: invalid program header entry size\n", name);
+    return 0;
   }
 
-  auto sec_start = reinterpret_cast<const SecHDR*>(data + e_shoff);
-  if (!checksize((char*)(sec_start + shnum-1) - data, sizeof(*sec_start),
-                 "section header array"))
+  size_t phsize = phnum * sizeof(ProgHDR);
+  if (!keep(e_phoff, phsize, "program header array") ||
+      !in.Advance(e_phoff + phsize))
   {
     return 0;
   }
-  auto findsec = [=](function<bool(const SecHDR*)> cond) -> const SecHDR* {
-    for (size_t i = 0; i != shnum; ++i) {
-      auto s = sec_start + i;
-      if (cond(s))
-        return s;
-    }
-    return 0;
-  };
+  // copied since stored ranges move when more of them are added
+  vec<ProgHDR> proghdrs(phnum);
+  if (phnum)
+    memcpy(&proghdrs[0], in.Get(e_phoff, phsize), phsize);
+  auto prog_start = proghdrs.data();
+  auto prog_end   = prog_start + phnum;
+
+  const ProgHDR *interp  = nullptr;
+  const ProgHDR *dynamic = nullptr;
+  size_t         load_at = size;
+  for (auto ph = prog_start; ph != prog_end; ++ph) {
+    auto p_type = Eswap<BE>(ph->p_type);
+    if (p_type == PT_INTERP && !interp)
+      interp = ph;
+    else if (p_type == PT_DYNAMIC && !dynamic)
+      dynamic = ph;
+    else if (p_type == PT_LOAD)
+      load_at = std::min(load_at, size_t(Eswap<BE>(ph->p_offset)));
+  }
 
-  auto dynhdr = findsec(
-    [](const SecHDR *hdr) {
-      return Eswap<BE>(hdr->sh_type) == SHT_DYNAMIC;
-    });
-  if (!dynhdr) {
+  if (!dynamic) {
     optconfig.Log(Debug,
-                  "%s: not a dynamic executable, no .dynamic section found\n",
+                  "%s: not a dynamic executable, no dynamic segment found\n",
                   name);
     *waserror = false;
     return 0;
   }
 
-  if (Eswap<BE>(dynhdr->sh_entsize) != sizeof(Dyn)) {
-    optconfig.Log(Error, "%s: invalid entsize for dynamic section\n", name);
+  // .dynstr is loadable and with every common linker layout it comes
+  // before the dynamic segment which tells us where it is
+  size_t interp_at = interp ? size_t(Eswap<BE>(interp->p_offset))  : 0;
+  size_t interp_sz = interp ? size_t(Eswap<BE>(interp->p_filesz))  : 0;
+  size_t dyn_at    = size_t(Eswap<BE>(dynamic->p_offset));
+  size_t dyn_sz    = size_t(Eswap<BE>(dynamic->p_filesz));
+  size_t dyncount  = dyn_sz / sizeof(Dyn);
+  if (!keep(interp_at, interp_sz, "interpreter") ||
+      !keep(dyn_at, dyncount * sizeof(Dyn), ".dynamic entries"))
+  {
     return 0;
   }
-
-  Dyn   *dyn_start = (Dyn*)(data + Eswap<BE>(dynhdr->sh_offset));
-#pragma clang diagnostic pop
-  size_t dyncount = Eswap<BE>(dynhdr->sh_size) / sizeof(Dyn);
-
-  if (!checksize((char*)(dyn_start + dyncount-1)-data, sizeof(Dyn),
-                 ".dynamic entries"))
-  {
+  // what lies before the end of the program headers has been read already
+  load_at = std::max(load_at, e_phoff + phsize);
+  if (load_at < dyn_at) {
+    size_t load_to = dyn_at;
+    if (reread && load_to - load_at > dynstr_window)
+      load_to = load_at + dynstr_window;
+    if (!keep(load_at, load_to - load_at, "loadable data"))
+      return 0;
+  }
+  if (!in.Advance(std::max(interp_at + interp_sz, dyn_at + dyn_sz)))
     return 0;
+
+  if (interp) {
+    // this one has an interpreter request
+    const char *str = in.Get(interp_at, interp_sz);
+    auto &info = object->info_;
+    info->interpreter_set_ = true;
+    info->interpreter_ = strings.Get(string(str, strnlen(str, interp_sz)));
   }
 
-  Dyn    *dynstr   = 0;
-  size_t  strsz    = 0;
+  auto dyn_start = reinterpret_cast<const Dyn*>(in.Get(dyn_at,
+                                                       dyncount*sizeof(Dyn)));
+
+  const Dyn *dynstr = 0;
+  size_t     strsz  = 0;
 
   for (size_t i = 0; i != dyncount; ++i) {
-    Dyn *dyn = dyn_start + i;
+    const Dyn *dyn = dyn_start + i;
     auto d_tag = Eswap<BE>(dyn->d_tag);
     if (d_tag == DT_STRTAB)
       dynstr = dyn;
@@ -155,19 +308,43 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
     return 0;
   }
 
-  // find string section with the offset from DT_STRTAB
-  auto dynstrsec = findsec([dynstr](const SecHDR *hdr) {
-    return Eswap<BE>(hdr->sh_type) == SHT_STRTAB &&
-           Eswap<BE>(hdr->sh_addr) == Eswap<BE>(dynstr->d_un.d_ptr);
-  });
-  if (!dynstrsec) {
+  // DT_STRTAB is an address, find the segment mapping it to the file
+  size_t dynstr_addr = Eswap<BE>(dynstr->d_un.d_ptr);
+  const ProgHDR *dynstrseg = nullptr;
+  for (auto ph = prog_start; ph != prog_end; ++ph) {
+    if (Eswap<BE>(ph->p_type) != PT_LOAD)
+      continue;
+    size_t vaddr = Eswap<BE>(ph->p_vaddr);
+    if (dynstr_addr >= vaddr &&
+        dynstr_addr - vaddr < size_t(Eswap<BE>(ph->p_filesz)))
+    {
+      dynstrseg = ph;
+      break;
+    }
+  }
+  if (!dynstrseg) {
     optconfig.Log(Error, "%s: Found no .dynstr section\n", name);
     return 0;
   }
 
-  auto dynstr_at = ssize_t(Eswap<BE>(dynstrsec->sh_offset));
-  if (!checksize(dynstr_at, strsz, "looking for .dynstr section"))
+  size_t dynstr_at = dynstr_addr - size_t(Eswap<BE>(dynstrseg->p_vaddr))
+                                 + size_t(Eswap<BE>(dynstrseg->p_offset));
+  if (reread && checksize(dynstr_at, strsz, "looking for .dynstr section") &&
+      !in.Keep(dynstr_at, dynstr_at + strsz))
+  {
+    optconfig.Log(Debug, "%s: .dynstr was skipped, reading it again\n", name);
+    *reread = true;
     return 0;
+  }
+  if (!keep(dynstr_at, strsz, "looking for .dynstr section") ||
+      !in.Advance(dynstr_at + strsz))
+  {
+    return 0;
+  }
+  const char *strtab = in.Get(dynstr_at, strsz);
+  dyn_start = reinterpret_cast<const Dyn*>(in.Get(dyn_at,
+                                                  dyncount*sizeof(Dyn)));
+#pragma clang diagnostic pop
 
   auto get_string = [=,&optconfig](size_t off) -> const char* {
     // range check
@@ -175,11 +352,11 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
       optconfig.Log(Error, "%s: out of bounds string entry\n", name);
       return 0;
     }
-    const char *str = data + dynstr_at + off;
-    const char *end = data + dynstr_at + strsz;
+    const char *str = strtab + off;
+    const char *end = strtab + strsz;
     const char *at  = str;
-    while (*str && str != end) ++str;
-    if (*str && str == end) {
+    while (str != end && *str) ++str;
+    if (str == end) {
       // missing terminating nul byte
       optconfig.Log(Error, "%s: unterminated string in string table\n", name);
       return 0;
@@ -188,7 +365,7 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
   };
 
   for (size_t i = 0; i != dyncount; ++i) {
-    Dyn        *dyn = dyn_start + i;
+    const Dyn  *dyn = dyn_start + i;
     const char *str;
     auto d_tag = Eswap<BE>(dyn->d_tag);
     auto d_ptr = Eswap<BE>(dyn->d_un.d_ptr);
@@ -196,19 +373,19 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
       case DT_NEEDED:
         if (! (str = get_string(d_ptr)) )
           return 0;
-        object->needed_.push_back(str);
+        object->info_->needed_.push_back(strings.Get(str));
         break;
       case DT_RPATH:
-        object->rpath_set_ = true;
+        object->info_->rpath_set_ = true;
         if (! (str = get_string(d_ptr)) )
           return 0;
-        object->rpath_ = str;
+        object->info_->rpath_ = strings.Get(str);
         break;
       case DT_RUNPATH:
-        object->runpath_set_ = true;
+        object->info_->runpath_set_ = true;
         if (! (str = get_string(d_ptr)) )
           return 0;
-        object->runpath_ = str;
+        object->info_->runpath_ = strings.Get(str);
         break;
       default:
         break;
@@ -220,20 +397,31 @@ Elf* LoadElf(const char *data, size_t size, bool *waserror, const char *name,
 }
 
 static const auto
-LoadElf32LE = &LoadElf<false, Elf32_Ehdr, Elf32_Shdr, Elf32_Phdr, Elf32_Dyn>;
+LoadElf32LE = &LoadElf<false, Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>;
 static const auto
-LoadElf32BE = &LoadElf<true,  Elf32_Ehdr, Elf32_Shdr, Elf32_Phdr, Elf32_Dyn>;
+LoadElf32BE = &LoadElf<true,  Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>;
 static const auto
-LoadElf64LE = &LoadElf<false, Elf64_Ehdr, Elf64_Shdr, Elf64_Phdr, Elf64_Dyn>;
+LoadElf64LE = &LoadElf<false, Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>;
 static const auto
-LoadElf64BE = &LoadElf<true,  Elf64_Ehdr, Elf64_Shdr, Elf64_Phdr, Elf64_Dyn>;
+LoadElf64BE = &LoadElf<true,  Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>;
 
-Elf* Elf::Open(const char *data, size_t size, bool *waserror, const char *name,
-               const Config &optconfig)
+Elf* Elf::Open(const function<read_func_t> &read, size_t size, bool *waserror,
+               const char *name, StringPool &strings,
+               const Config &optconfig, bool *reread)
 {
+  ElfReader in(read, size, name, optconfig);
+  if (reread)
+    *reread = false;
+
+  // peek at the header, the 64 bit one is the larger one
+  *waserror = true;
+  if (!in.Keep(0, sizeof(Elf64_Ehdr)) || !in.Advance(sizeof(Elf64_Ehdr)))
+    return 0;
+
   *waserror = false;
-  unsigned char *elf_ident = (unsigned char*)data;
-  if (elf_ident[EI_MAG0] != ELFMAG0 ||
+  auto elf_ident = reinterpret_cast<const unsigned char*>(in.Get(0, EI_NIDENT));
+  if (!elf_ident ||
+      elf_ident[EI_MAG0] != ELFMAG0 ||
       elf_ident[EI_MAG1] != ELFMAG1 ||
       elf_ident[EI_MAG2] != ELFMAG2 ||
       elf_ident[EI_MAG3] != ELFMAG3)
@@ -275,14 +463,14 @@ Elf* Elf::Open(const char *data, size_t size, bool *waserror, const char *name,
   Elf *e = 0;
   if (ei_class == ELFCLASS32) {
     if (ei_data == ELFDATA2LSB)
-      e = LoadElf32LE(data, size, waserror, name, optconfig);
+      e = LoadElf32LE(in, waserror, reread, name, strings, optconfig);
     else
-      e = LoadElf32BE(data, size, waserror, name, optconfig);
+      e = LoadElf32BE(in, waserror, reread, name, strings, optconfig);
   } else if (ei_class == ELFCLASS64) {
     if (ei_data == ELFDATA2LSB)
-      e = LoadElf64LE(data, size, waserror, name, optconfig);
+      e = LoadElf64LE(in, waserror, reread, name, strings, optconfig);
     else
-      e = LoadElf64BE(data, size, waserror, name, optconfig);
+      e = LoadElf64BE(in, waserror, reread, name, strings, optconfig);
   }
   if (!e)
     return 0;
@@ -367,7 +555,10 @@ void fixpathlist(string& list) {
   list.append(move(sub));
 }
 
-static void replace_origin(string& path, const string& origin) {
+static istring replace_origin(const string& orig, const string& origin,
+                              StringPool &strings)
+{
+  string path(orig);
   size_t at = 0;
   do {
     at = path.find("$ORIGIN", at);
@@ -378,13 +569,14 @@ static void replace_origin(string& path, const string& origin) {
     at += origin.length();
   } while (at < path.length());
   fixpathlist(path);
+  return strings.Get(move(path));
 }
 
-void Elf::SolvePaths(const string& origin) {
-  if (rpath_set_)
-    replace_origin(rpath_, origin);
-  if (runpath_set_)
-    replace_origin(runpath_, origin);
+void Elf::SolvePaths(const string& origin, StringPool &strings) {
+  if (info_->rpath_set_)
+    info_->rpath_ = replace_origin(info_->rpath_, origin, strings);
+  if (info_->runpath_set_)
+    info_->runpath_ = replace_origin(info_->runpath_, origin, strings);
 }
 
 const char* Elf::classString() const {
@@ -3,32 +3,51 @@
 
 namespace pkgdepdb {
 
+// The dynamic section data of an object file. Symlinks to the file are
+// Elf objects of their own sharing the same info.
+struct ElfInfo {
+  size_t refcount_ = 0;
+
+  // requirements:
+  bool        rpath_set_       = false;
+  bool        runpath_set_     = false;
+  bool        interpreter_set_ = false;
+  istring     rpath_;
+  istring     runpath_;
+  istring     interpreter_;
+  IStringList needed_;
+
+  bool operator==(const ElfInfo&) const;
+  size_t Hash() const;
+};
+
 struct Elf {
   size_t refcount_ = 0;
 
   // path + name separated
-  string dirname_;
-  string basename_;
+  istring dirname_;
+  istring basename_;
 
   // classification:
   unsigned char ei_class_; // 32/64 bit
   unsigned char ei_data_;  // endianess
   unsigned char ei_osabi_; // freebsd/linux/...
 
-  // requirements:
-  bool        rpath_set_       = false;
-  bool        runpath_set_     = false;
-  bool        interpreter_set_ = false;
-  string      rpath_;
-  string      runpath_;
-  string      interpreter_;
-  vec<string> needed_;
+  rptr<ElfInfo> info_;
 
 // non-serialized {
   // not serialized INSIDE the object, but as part of the DB
   // (for compatibility with older database dumps)
-  ObjectSet req_found_;
-  StringSet req_missing_;
+  ObjectSet  req_found_;
+  IStringSet req_missing_;
+
+  // NOT SERIALIZED: objects which have this one in their req_found_
+  std::set<Elf*> found_by_;
+
+  // NOT SERIALIZED: interned dirname_ and the sorted set of interned
+  // directories this object searches, maintained by the DB
+  uint32_t      dir_id_ = 0;
+  vec<uint32_t> search_path_;
 
   // NOT SERIALIZED:
   struct {
@@ -39,13 +58,20 @@ struct Elf {
 // }
 
 
+  // reads up to length bytes, returns the count, 0 at EOF or -1 on error
+  using read_func_t = ssize_t(char *buffer, size_t length);
+
   Elf();
   Elf(const Elf& cp);
-  static Elf* Open(const char* data, size_t size, bool *err, const char *name,
-                   const Config&);
+  // reads the object sequentially, only fetching the parts it needs; when
+  // reread is given and the string table turns out to be in a part already
+  // dropped, *reread is set and the object has to be opened again without
+  static Elf* Open(const function<read_func_t>& read, size_t size, bool *err,
+                   const char *name, StringPool&, const Config&,
+                   bool *reread = nullptr);
 
   // utility functions while loading
-  void SolvePaths(const string& origin);
+  void SolvePaths(const string& origin, StringPool&);
   bool CanUse(const Elf &other, bool strict) const;
 
   // utility functions for printing stuff
@@ -27,11 +27,16 @@ namespace filter {
 Match::Match() {}
 Match::~Match() {}
 
+const string* Match::exact() const {
+  return nullptr;
+}
+
 class ExactMatch : public Match {
  public:
   string text_;
   ExactMatch(string&&);
   bool operator()(const string&) const override;
+  const string* exact() const override { return &text_; }
 };
 
 class GlobMatch : public Match {
@@ -253,10 +258,24 @@ static bool match_glob(const string &glob, size_t g,
   }
 }
 
+// name filters can tell the database which package they want
+class PkgNameFilt : public PkgFilt {
+ public:
+  rptr<Match> matcher_;
+
+  PkgNameFilt(bool neg, rptr<Match> matcher)
+  : PkgFilt(neg, [matcher](const Package &pkg) {
+      return (*matcher)(pkg.name_);
+    }),
+    matcher_(matcher) {}
+
+  const string* exact_name() const override {
+    return negate_ ? nullptr : matcher_->exact();
+  }
+};
+
 uniq<PackageFilter> PackageFilter::name(rptr<Match> matcher, bool neg) {
-  return mk_unique<PkgFilt>(neg, [matcher](const Package &pkg) {
-    return (*matcher)(pkg.name_);
-  });
+  return mk_unique<PkgNameFilt>(neg, matcher);
 }
 
 template<typename CONT>
@@ -284,11 +303,31 @@ MAKE_PKGFILTER1(optdepends)
 MAKE_PKGFILTER1(provides)
 MAKE_PKGFILTER1(conflicts)
 MAKE_PKGFILTER1(replaces)
-MAKE_PKGFILTER(contains,filelist)
 
 #undef MAKE_PKGFILTER
 #undef MAKE_PKGFILTER1
 
+// file lists are only loaded when something asks for them
+class PkgFileFilt : public PkgFilt {
+ public:
+  PkgFileFilt(bool neg, function<bool(const Package&)> &&fn)
+  : PkgFilt(neg, move(fn)) {}
+
+  bool uses_filelists() const override {
+    return true;
+  }
+};
+
+uniq<PackageFilter> PackageFilter::contains(rptr<Match> matcher, bool neg) {
+  return mk_unique<PkgFileFilt>(neg, [matcher](const Package &pkg) {
+    for (auto &file : pkg.filelist_) {
+      if ((*matcher)(file))
+        return true;
+    }
+    return false;
+  });
+}
+
 uniq<PackageFilter>
 PackageFilter::alldepends(rptr<Match> matcher, bool neg) {
   return mk_unique<PkgFilt>(neg, [matcher](const Package &pkg) {
@@ -353,7 +392,7 @@ uniq<ObjectFilter> ObjectFilter::path(rptr<Match> matcher, bool neg) {
 
 uniq<ObjectFilter> ObjectFilter::depends(rptr<Match> matcher, bool neg) {
   return mk_unique<ObjFilt>(neg, [matcher](const Elf &elf) {
-    for (auto &i : elf.needed_)
+    for (auto &i : elf.info_->needed_)
       if ((*matcher)(i))
         return true;
     return false;
@@ -362,19 +401,19 @@ uniq<ObjectFilter> ObjectFilter::depends(rptr<Match> matcher, bool neg) {
 
 uniq<ObjectFilter> ObjectFilter::rpath(rptr<Match> matcher, bool neg) {
   return mk_unique<ObjFilt>(neg, [matcher](const Elf &elf) {
-    return elf.rpath_set_ && (*matcher)(elf.rpath_);
+    return elf.info_->rpath_set_ && (*matcher)(elf.info_->rpath_);
   });
 }
 
 uniq<ObjectFilter> ObjectFilter::runpath(rptr<Match> matcher, bool neg) {
   return mk_unique<ObjFilt>(neg, [matcher](const Elf &elf) {
-    return elf.runpath_set_ && (*matcher)(elf.runpath_);
+    return elf.info_->runpath_set_ && (*matcher)(elf.info_->runpath_);
   });
 }
 
 uniq<ObjectFilter> ObjectFilter::interp(rptr<Match> matcher, bool neg) {
   return mk_unique<ObjFilt>(neg, [matcher](const Elf &elf) {
-    return elf.interpreter_set_ && (*matcher)(elf.interpreter_);
+    return elf.info_->interpreter_set_ && (*matcher)(elf.info_->interpreter_);
   });
 }
 
@@ -11,6 +11,8 @@ class Match {
   Match();
   virtual ~Match();
   virtual bool operator()(const string&) const = 0;
+  // the only string this matches, if there is just one
+  virtual const string* exact() const;
 
   static rptr<Match> CreateExact(string &&text);
   static rptr<Match> CreateGlob (string &&text);
@@ -36,6 +38,14 @@ class PackageFilter {
   inline bool operator()(const DB& db, const Package &pkg) const {
     return visible(db, pkg) != negate_;
   }
+  // the one package name this filter lets through, if there is one
+  virtual const string* exact_name() const {
+    return nullptr;
+  }
+  // whether the packages' file lists have to be loaded for this filter
+  virtual bool uses_filelists() const {
+    return false;
+  }
 
   static uniq<PackageFilter> name         (rptr<Match>, bool neg);
   static uniq<PackageFilter> group        (rptr<Match>, bool neg);
@@ -5,6 +5,9 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <limits.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -15,6 +18,7 @@
 #include "package.h"
 #include "db.h"
 #include "filter.h"
+#include "threads.h"
 
 using namespace pkgdepdb;
 
@@ -68,6 +72,10 @@ static struct option long_opts[] = {
 
   { "touch",      no_argument,       0, -1024-'T' },
 
+  { "trace-links", no_argument,      0, -1024-'L' },
+
+  { "compression-level", required_argument, 0, -1024-'C' },
+
   { 0, 0, 0, 0 }
 };
 
@@ -81,6 +89,7 @@ static void help [[noreturn]] (int x) {
     "  --version          show version info\n"
     "  -v, --verbose      print more information\n"
     "  -q, --quiet        suppress progress messages\n"
+    "  --trace-links      show how each library dependency is resolved\n"
     "  --depends=<YES|NO> enable or disable package dependencies\n"
     "  --files=<YES|NO>   whether to store all non-object files of packages\n"
     "  -J, --json=PART    activate json mode for parts of the program\n"
@@ -107,6 +116,8 @@ static void help [[noreturn]] (int x) {
     "  -R, --rule=CMD     modify rules\n"
     "  --wipe             remove all packages, keep rules/settings\n"
     "  --touch            write out the db even without modifications\n"
+    "  --compression-level=N\n"
+    "                     compression level used when writing the db\n"
     );
   fprintf(out,
     "db query options:\n"
@@ -199,6 +210,9 @@ static bool parse_filter(const string &filter,
                          FilterList&,
                          ObjFilterList&,
                          StrFilterList&);
+static vec<Package*> open_packages(char **files, size_t count,
+                                   StringPool &strings,
+                                   const Config &config);
 
 int main(int argc, char **argv) {
   arg0 = argv[0];
@@ -299,6 +313,20 @@ int main(int argc, char **argv) {
       case -'G': oldmode = false; do_integrity = true; break;
 
       case -1024-'T': oldmode = false; modified = true; break;
+      case -1024-'L': config.trace_links_ = true; break;
+
+      case -1024-'C':
+      {
+        char *end;
+        unsigned long level = strtoul(optarg, &end, 10);
+        if (!isdigit(optarg[0]) || *end || level > 22) {
+          fprintf(stderr,
+                  "--compression-level has to be a number from 0 to 22\n");
+          help(1);
+        }
+        config.compression_level_ = uint(level);
+        break;
+      }
 
       case -1024-'D':
         config.package_depends_ = Config::str2bool(optarg);
@@ -402,8 +430,9 @@ int main(int argc, char **argv) {
     // non-database mode!
     if (optind >= argc)
       help(1);
+    StringPool strings;
     while (optind < argc) {
-      Package *package = Package::Open(argv[optind++], config);
+      Package *package = Package::Open(argv[optind++], strings, config);
       package->ShowNeeded();
       delete package;
     }
@@ -422,23 +451,27 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  // packages are loaded into the database's string pool
+  uniq<DB> db(new DB(config));
+
   if (!do_delete && optind < argc) {
     if (do_install)
       config.Log(Message, "loading packages...\n");
 
+    if (do_install) {
+      packages = open_packages(argv+optind, argc-optind, *db->strings_,
+                               config);
+      optind = argc;
+      packages.erase(std::remove(packages.begin(), packages.end(), nullptr),
+                     packages.end());
+    }
     while (optind < argc) {
-      if (do_install)
-        config.Log(Print, "  %s\n", argv[optind]);
-      Package *package = Package::Open(argv[optind], config);
+      Package *package = Package::Open(argv[optind], *db->strings_, config);
       if (!package)
         config.Log(Error, "error reading package %s\n", argv[optind]);
       else {
-        if (do_install)
-          packages.push_back(package);
-        else {
-          package->ShowNeeded();
-          delete package;
-        }
+        package->ShowNeeded();
+        delete package;
       }
       ++optind;
     }
@@ -447,12 +480,18 @@ int main(int argc, char **argv) {
       config.Log(Message, "packages loaded...\n");
   }
 
-  uniq<DB> db(new DB(config));
   if (has_db) {
     if (!db->Read(dbfile)) {
       config.Log(Error, "failed to read database\n");
       return 1;
     }
+    for (auto &filter : pkg_filters) {
+      if (filter->uses_filelists()) {
+        if (!db->LoadFilelists())
+          return 1;
+        break;
+      }
+    }
   }
 
   if (do_rename) {
@@ -493,6 +532,8 @@ int main(int argc, char **argv) {
     db->FixPaths();
   }
 
+  // the packages installed before a failure are still stored
+  bool install_failed = false;
   if (do_install && packages.size()) {
     config.Log(Message, "installing packages\n");
     for (auto pkg : packages) {
@@ -500,6 +541,7 @@ int main(int argc, char **argv) {
       if (!db->InstallPackage(move(pkg))) {
         printf("failed to commit package %s to database\n",
                pkg->name_.c_str());
+        install_failed = true;
         break;
       }
     }
@@ -550,11 +592,64 @@ int main(int argc, char **argv) {
   if (!dryrun && modified && has_db) {
     if (config.json_ & JSONBits::DB)
       db_store_json(db.get(), dbfile);
-    else if (!db->Store(dbfile))
+    else if (!db->Store(dbfile)) {
       config.Log(Error, "failed to write to the database\n");
+      return 1;
+    }
   }
 
-  return 0;
+  // the file lists were needed but could not be read
+  return (install_failed || db->filelists_failed_) ? 1 : 0;
+}
+
+// Archives are opened in parallel, biggest first so a large package does
+// not end up running alone at the end. The result is in command line order
+// with nullptr for archives which failed to load. In parallel each package
+// is listed once it is loaded.
+static vec<Package*> open_packages(char **files, size_t count,
+                                   StringPool &strings,
+                                   const Config &config)
+{
+  vec<Package*> packages(count, nullptr);
+#ifdef PKGDEPDB_ENABLE_THREADS
+  unsigned long threadcount = thread::threadcount(config);
+  if (threadcount > 1 && count > 1) {
+    vec<std::pair<off_t, size_t>> order;
+    order.reserve(count);
+    for (size_t i = 0; i != count; ++i) {
+      struct stat st;
+      order.emplace_back(::stat(files[i], &st) == 0 ? st.st_size : 0, i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+      [](const std::pair<off_t, size_t> &a,
+         const std::pair<off_t, size_t> &b)
+      {
+        return a.first > b.first;
+      });
+
+    std::atomic_size_t cursor(0);
+    std::mutex         log_mutex;
+    thread::pool(config).Run(threadcount, [&](unsigned long) {
+      size_t at;
+      while ((at = cursor++) < count) {
+        size_t i = order[at].second;
+        packages[i] = Package::Open(files[i], strings, config);
+        std::lock_guard<std::mutex> lock(log_mutex);
+        config.Log(Print, "  %s\n", files[i]);
+        if (!packages[i])
+          config.Log(Error, "error reading package %s\n", files[i]);
+      }
+    });
+    return packages;
+  }
+#endif
+  for (size_t i = 0; i != count; ++i) {
+    config.Log(Print, "  %s\n", files[i]);
+    packages[i] = Package::Open(files[i], strings, config);
+    if (!packages[i])
+      config.Log(Error, "error reading package %s\n", files[i]);
+  }
+  return packages;
 }
 
 static bool try_rule(const string                 &rule,
@@ -18,41 +18,59 @@ using vec = ::std::vector<T,Alloc>;
 using StringList = vec<string>;
 
 #include <map>
+#include <unordered_map>
 
 #include <set>
 using StringSet  = std::set<string>;
 
+#include <unordered_set>
+
 #include <functional>
 using std::function;
 
-#include "util.h"
-
 #include "config.h"
 
+#ifdef PKGDEPDB_ENABLE_THREADS
+#  include <atomic>
+#  include <thread>
+#  include <mutex>
+#  include <condition_variable>
+#endif
+
+#include "util.h"
+
 namespace pkgdepdb {
 
 typedef unsigned int uint;
 
+using IStringList = vec<istring>;
+using IStringSet  = std::set<istring>;
+
 struct Elf;
 using ObjectSet   = std::set<rptr<Elf>>;
 using ObjectList  = vec<rptr<Elf>>;
 struct Package;
 using PackageList = vec<Package*>;
+struct Dependency;
+using DependList  = vec<Dependency>;
+class VercmpCache;
 
-#ifdef PKGDEPDB_WITH_ALPM
-bool split_depstring  (const string &str, string &name, string &op, string &v);
-bool package_satisfies(const Package *other,
-                       const string &dep,
-                       const string &op,
-                       const string &ver);
-#endif
+bool package_satisfies(const Package     *other,
+                       const Dependency  &dep,
+                       const VercmpCache &vercmp);
 
 void fixpath    (string& path);
 void fixpathlist(string& pathlist);
 
-using PkgMap     = std::map<string, const Package*>;
-using PkgListMap = std::map<string, vec<const Package*>>;
+using PkgMap     = std::unordered_map<istring, const Package*>;
+// the package found by a name, the first one of it in DB::packages_
+using PkgIndex   = std::unordered_map<istring, Package*>;
+using PkgListMap = std::unordered_map<istring, vec<const Package*>>;
 using ObjListMap = std::map<string, vec<const Elf*>>;
+// objects by basename, each list kept in DB::objects_ order
+using ObjIndex   = std::unordered_map<istring, vec<Elf*>>;
+// objects by the names in their req_missing_ sets
+using SeekerMap  = std::unordered_map<istring, std::set<Elf*>>;
 
 namespace filter {
 class PackageFilter;
@@ -1,4 +1,5 @@
 #include <memory>
+#include <algorithm>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -47,7 +48,7 @@ static bool ends_word(const char c) {
 // is way less strict about the formatting, as we skip whitespace
 // between every word, whereas pacman matches /^(\w+) = (.*)$/ exactly.
 static bool read_info(Package *pkg, struct archive *tar, const size_t size,
-                      const Config& optconfig)
+                      StringPool &strings, const Config& optconfig)
 {
   vec<char> data(size);
   ssize_t rc = archive_read_data(tar, &data[0], size);
@@ -106,13 +107,15 @@ static bool read_info(Package *pkg, struct archive *tar, const size_t size,
   while (pos < size) {
     skipwhite();
     if (isentry("pkgname", sizeof("pkgname")-1)) {
-      if (!getvalue("pkgname", pkg->name_))
+      if (!getvalue("pkgname", es))
         return false;
+      pkg->name_ = strings.Get(es);
       continue;
     }
     if (isentry("pkgver", sizeof("pkgver")-1)) {
-      if (!getvalue("pkgver", pkg->version_))
+      if (!getvalue("pkgver", es))
         return false;
+      pkg->version_ = strings.Get(es);
       continue;
     }
 
@@ -124,7 +127,7 @@ static bool read_info(Package *pkg, struct archive *tar, const size_t size,
     if (isentry("depend", sizeof("depend")-1)) {
       if (!getvalue("depend", es))
         return false;
-      pkg->depends_.push_back(es);
+      pkg->depends_.emplace_back(es, strings);
       continue;
     }
     if (isentry("optdepend", sizeof("optdepend")-1)) {
@@ -134,31 +137,31 @@ static bool read_info(Package *pkg, struct archive *tar, const size_t size,
       if (c != string::npos)
         es.erase(c);
       if (es.length())
-        pkg->optdepends_.push_back(es);
+        pkg->optdepends_.emplace_back(es, strings);
       continue;
     }
     if (isentry("replace", sizeof("replaces")-1)) {
       if (!getvalue("replaces", es))
         return false;
-      pkg->replaces_.push_back(es);
+      pkg->replaces_.emplace_back(es, strings);
       continue;
     }
     if (isentry("conflict", sizeof("conflict")-1)) {
       if (!getvalue("conflict", es))
         return false;
-      pkg->conflicts_.push_back(es);
+      pkg->conflicts_.emplace_back(es, strings);
       continue;
     }
     if (isentry("provides", sizeof("provides")-1)) {
       if (!getvalue("provides", es))
         return false;
-      pkg->provides_.push_back(es);
+      pkg->provides_.emplace_back(es, strings);
       continue;
     }
     if (isentry("group", sizeof("group")-1)) {
       if (!getvalue("group", es))
         return false;
-      pkg->groups_.insert(es);
+      pkg->groups_.insert(strings.Get(es));
       continue;
     }
 
@@ -179,28 +182,58 @@ std::tuple<string, string> splitpath(const string& path)
   return std::make_tuple(path.substr(0, slash), path.substr(slash+1));
 }
 
+// Opens the archive again to read an object which needs more than the
+// sequential pass kept, this is rare enough not to bother with seeking.
+static Elf* reread_object(const string  &path,
+                          const string  &filename,
+                          size_t         size,
+                          bool          *err,
+                          StringPool    &strings,
+                          const Config  &optconfig)
+{
+  struct archive *tar = archive_read_new();
+  guard close_tar([tar]() { archive_read_free(tar); });
+  archive_read_support_filter_all(tar);
+  archive_read_support_format_all(tar);
+
+  *err = true;
+  if (ARCHIVE_OK != archive_read_open_filename(tar, path.c_str(), 10240)) {
+    optconfig.Log(Error, "failed to reopen %s\n", path.c_str());
+    return nullptr;
+  }
+  struct archive_entry *entry;
+  while (ARCHIVE_OK == archive_read_next_header(tar, &entry)) {
+    if (filename != archive_entry_pathname(entry))
+      continue;
+    return Elf::Open(
+      [tar](char *buffer, size_t length) -> ssize_t {
+        return archive_read_data(tar, buffer, length);
+      },
+      size, err, filename.c_str(), strings, optconfig);
+  }
+  optconfig.Log(Error, "%s vanished from %s\n", filename.c_str(),
+                path.c_str());
+  return nullptr;
+}
+
 static bool read_object(Package         *pkg,
                         struct archive  *tar,
                         string         &&filename,
                         size_t           size,
+                        StringPool      &strings,
                         const Config    &optconfig)
 {
-  vec<char> data;
-  data.resize(size);
-
-  ssize_t rc = archive_read_data(tar, &data[0], size);
-  if (rc < 0) {
-    optconfig.Log(Error, "failed to read from archive stream\n");
-    return false;
-  }
-  else if ((size_t)rc != size) {
-    optconfig.Log(Error, "file was short: %s\n", filename.c_str());
-    return false;
-  }
-
-  bool err = false;
-  rptr<Elf> object(Elf::Open(&data[0], data.size(), &err, filename.c_str(),
-                             optconfig));
+  bool err = false, reread = false;
+  rptr<Elf> object(Elf::Open(
+    [tar](char *buffer, size_t length) -> ssize_t {
+      return archive_read_data(tar, buffer, length);
+    },
+    size, &err, filename.c_str(), strings, optconfig, &reread));
+  // whatever the object didn't need (or all of a non-ELF file)
+  archive_read_data_skip(tar);
+  if (reread)
+    object = reread_object(pkg->load_.path, filename, size, &err, strings,
+                           optconfig);
   if (!object.get()) {
     if (err)
       optconfig.Log(Error, "error in: %s\n", filename.c_str());
@@ -208,9 +241,9 @@ static bool read_object(Package         *pkg,
   }
 
   auto split(move(splitpath(filename)));
-  object->dirname_  = move(std::get<0>(split));
-  object->basename_ = move(std::get<1>(split));
-  object->SolvePaths(object->dirname_);
+  object->dirname_  = strings.Get(move(std::get<0>(split)));
+  object->basename_ = strings.Get(move(std::get<1>(split)));
+  object->SolvePaths(object->dirname_, strings);
 
   pkg->objects_.push_back(object);
 
@@ -220,6 +253,7 @@ static bool read_object(Package         *pkg,
 static bool add_entry(Package              *pkg,
                       struct archive       *tar,
                       struct archive_entry *entry,
+                      StringPool           &strings,
                       const Config&         optconfig)
 {
   string filename(archive_entry_pathname(entry));
@@ -267,9 +301,9 @@ static bool add_entry(Package              *pkg,
   auto size = static_cast<size_t>(isize);
 
   if (isinfo)
-    return read_info(pkg, tar, size, optconfig);
+    return read_info(pkg, tar, size, strings, optconfig);
 
-  return read_object(pkg, tar, move(filename), size, optconfig);
+  return read_object(pkg, tar, move(filename), size, strings, optconfig);
 }
 
 Elf* Package::Find(const string& dirname, const string& basename) const {
@@ -280,7 +314,7 @@ Elf* Package::Find(const string& dirname, const string& basename) const {
   return nullptr;
 }
 
-void Package::Guess(const string& path) {
+void Package::Guess(const string& path, StringPool &strings) {
   // extract the basename:
   size_t at = path.find_last_of('/');
   string base(at == string::npos ? path : path.substr(at+1));
@@ -309,7 +343,7 @@ void Package::Guess(const string& path) {
     to = base.find_first_of("-.", to+1);
   }
 
-  name_ = base.substr(0, to);
+  name_ = strings.Get(base.substr(0, to));
   if (base[to] != '-' || !(base[to+1] >= '0' && base[to+1] <= '9')) {
     // no version
     return;
@@ -321,7 +355,7 @@ void Package::Guess(const string& path) {
 
   if (to == string::npos) {
     // we'll take it...
-    version_ = base.substr(from);
+    version_ = strings.Get(base.substr(from));
     return;
   }
 
@@ -336,22 +370,140 @@ void Package::Guess(const string& path) {
     to = base.find_first_of("-.", to+1);
   }
 
-  version_ = base.substr(from, to-from);
-  if (!slack || to == string::npos)
-    return;
+  string version(base.substr(from, to-from));
+  if (slack && to != string::npos) {
+    // slackware build-name comes right before the extension
+    to = base.find_last_of('.');
+    if (to && to != string::npos) {
+      from = base.find_last_of("-.", to-1);
+      if (from && from != string::npos) {
+        version.append(1, '-');
+        version.append(base.substr(from+1, to-from-1));
+      }
+    }
+  }
+  version_ = strings.Get(move(version));
+}
 
-  // slackware build-name comes right before the extension
-  to = base.find_last_of('.');
-  if (!to || to == string::npos)
+// Symlinks to objects become aliases of the objects they point to. Links
+// to links are resolved once their target is, and the copies are added
+// in the same order repeated scans over the sorted link list would add
+// them: a link resolves in the same round as its target if it comes after
+// it in the list, otherwise in the next one.
+static void resolve_symlinks(Package *pkg, StringPool &strings) {
+  auto &symlinks = pkg->load_.symlinks;
+  if (symlinks.empty())
     return;
-  from = base.find_last_of("-.", to-1);
-  if (from && from != string::npos) {
-    version_.append(1, '-');
-    version_.append(base.substr(from+1, to-from-1));
+
+  std::unordered_map<string, Elf*> objects;
+  for (auto &obj : pkg->objects_)
+    objects.emplace(obj->dirname_ + "/" + obj->basename_, obj.get());
+
+  static const size_t none = size_t(-1);
+  struct Link {
+    std::tuple<string, string> from;
+    Elf                       *object; // target if it is an object
+    size_t                     next;   // target if it is another link
+    unsigned                   round;  // 0 if it cannot be resolved
+  };
+  vec<Link> links;
+  links.reserve(symlinks.size());
+  vec<string> targets;
+  targets.reserve(symlinks.size());
+  std::unordered_map<string, size_t> linkpaths;
+
+  for (auto &link : symlinks) {
+    auto linkfrom = splitpath(link.first);
+    linkpaths.emplace(std::get<0>(linkfrom) + "/" + std::get<1>(linkfrom),
+                      links.size());
+    links.push_back({ move(linkfrom), nullptr, none, 0 });
+
+    // handle relative as well as absolute symlinks
+    if (!link.second.length()) {
+      // illegal
+      targets.emplace_back();
+      continue;
+    }
+    decltype(linkfrom) linkto;
+    if (link.second[0] == '/') // absolute
+      linkto = splitpath(link.second);
+    else // relative
+      linkto = splitpath(std::get<0>(links.back().from) + "/" + link.second);
+    targets.emplace_back(std::get<0>(linkto) + "/" + std::get<1>(linkto));
+  }
+
+  for (size_t i = 0; i != links.size(); ++i) {
+    if (!targets[i].length())
+      continue;
+    auto obj = objects.find(targets[i]);
+    if (obj != objects.end()) {
+      links[i].object = obj->second;
+      continue;
+    }
+    auto next = linkpaths.find(targets[i]);
+    if (next != linkpaths.end())
+      links[i].next = next->second;
+  }
+
+  // figure out the round each link is resolved in, without recursion since
+  // link chains can be long
+  enum { New, Visiting, Done };
+  vec<char>   state(links.size(), New);
+  vec<size_t> stack;
+  for (size_t i = 0; i != links.size(); ++i) {
+    stack.push_back(i);
+    while (!stack.empty()) {
+      size_t at   = stack.back();
+      Link  &link = links[at];
+      if (state[at] == Done) {
+        stack.pop_back();
+        continue;
+      }
+      if (link.object)
+        link.round = 1;
+      else if (link.next != none && state[link.next] != Done) {
+        if (state[link.next] == New) {
+          state[at] = Visiting;
+          stack.push_back(link.next);
+          continue;
+        }
+        // cycle: stays unresolved
+      }
+      else if (link.next != none && links[link.next].round) {
+        link.round = links[link.next].round + (link.next < at ? 0 : 1);
+      }
+      state[at] = Done;
+      stack.pop_back();
+    }
+  }
+
+  vec<size_t> order;
+  for (size_t i = 0; i != links.size(); ++i) {
+    if (links[i].round)
+      order.push_back(i);
   }
+  std::stable_sort(order.begin(), order.end(),
+    [&links](size_t a, size_t b) { return links[a].round < links[b].round; });
+
+  vec<Elf*> copies(links.size(), nullptr);
+  for (size_t i : order) {
+    Link &link = links[i];
+    Elf  *obj  = link.object ? link.object : copies[link.next];
+
+    // the copy shares the object's info, whose paths are already solved
+    Elf *copy = new Elf(*obj);
+    copy->dirname_  = strings.Get(move(std::get<0>(link.from)));
+    copy->basename_ = strings.Get(move(std::get<1>(link.from)));
+
+    pkg->objects_.push_back(copy);
+    copies[i] = copy;
+  }
+  symlinks.clear();
 }
 
-Package* Package::Open(const string& path, const Config& optconfig) {
+Package* Package::Open(const string& path, StringPool &strings,
+                       const Config& optconfig)
+{
   uniq<Package> package(new Package);
 
   struct archive *tar = archive_read_new();
@@ -362,56 +514,20 @@ Package* Package::Open(const string& path, const Config& optconfig) {
   if (ARCHIVE_OK != archive_read_open_filename(tar, path.c_str(), 10240)) {
     return 0;
   }
+  package->load_.path = path;
 
   while (ARCHIVE_OK == archive_read_next_header(tar, &entry)) {
-    if (!add_entry(package.get(), tar, entry, optconfig))
+    if (!add_entry(package.get(), tar, entry, strings, optconfig))
       return 0;
   }
 
   archive_read_free(tar);
 
   if (!package->name_.length() && !package->version_.length())
-    package->Guess(path);
-
-  bool changed;
-  do {
-    changed = false;
-    for (auto link = package->load_.symlinks.begin(); link != package->load_.symlinks.end();)
-    {
-      auto linkfrom = splitpath(link->first);
-      decltype(linkfrom) linkto;
-
-      // handle relative as well as absolute symlinks
-      if (!link->second.length()) {
-        // illegal
-        ++link;
-        continue;
-      }
-      if (link->second[0] == '/') // absolute
-        linkto = splitpath(link->second);
-      else // relative
-      {
-        string fullpath = std::get<0>(linkfrom) + "/" + link->second;
-        linkto = splitpath(fullpath);
-      }
-
-      Elf *obj = package->Find(std::get<0>(linkto), std::get<1>(linkto));
-      if (!obj) {
-        ++link;
-        continue;
-      }
-      changed = true;
+    package->Guess(path, strings);
 
-      Elf *copy = new Elf(*obj);
-      copy->dirname_  = move(std::get<0>(linkfrom));
-      copy->basename_ = move(std::get<1>(linkfrom));
-      copy->SolvePaths(obj->dirname_);
-
-      package->objects_.push_back(copy);
-      package->load_.symlinks.erase(link++);
-    }
-  } while (changed);
-  package->load_.symlinks.clear();
+  resolve_symlinks(package.get(), strings);
+  package->load_.path.clear();
 
   return package.release();
 }
@@ -421,72 +537,67 @@ void Package::ShowNeeded() {
   for (auto &obj : objects_) {
     string path = obj->dirname_ + "/" + obj->basename_;
     const char *objname = path.c_str();
-    for (auto &need : obj->needed_) {
+    for (auto &need : obj->info_->needed_) {
       printf("%s: %s NEEDS %s\n", name, objname, need.c_str());
     }
   }
 }
 
-bool Package::ConflictsWith(const Package &other) const {
-  for (auto &conf : conflicts_) {
-#ifdef PKGDEPDB_WITH_ALPM
-    string name, op, ver;
-    split_depstring(conf, name, op, ver);
-    if (ver.length()) {
-      if (package_satisfies(&other, name, op, ver))
+// whether one of the entries names the other package or something it
+// provides
+static bool names_package(const DependList  &list,
+                          const Package     &other,
+                          const VercmpCache &vercmp)
+{
+  for (auto &dep : list) {
+    if (!dep.version_.empty()) {
+      if (package_satisfies(&other, dep, vercmp))
         return true;
-    } else {
-#else
-      string &name(conf);
-#endif
-      if (other.name_ == name)
+      continue;
+    }
+    if (other.name_ == dep.name_)
+      return true;
+    for (auto &prov : other.provides_) {
+      if (prov.name_ == dep.name_)
         return true;
-      for (auto &prov : other.provides_) {
-#ifdef PKGDEPDB_WITH_ALPM
-        string provname;
-        split_depstring(prov, provname, op, ver);
-#else
-        string &provname(prov);
-#endif
-        if (provname == name)
-          return true;
-      }
-#ifdef PKGDEPDB_WITH_ALPM
     }
-#endif
   }
   return false;
 }
 
-bool Package::Replaces(const Package &other) const {
-  for (auto &conf : replaces_) {
-#ifdef PKGDEPDB_WITH_ALPM
-    string name, op, ver;
-    split_depstring(conf, name, op, ver);
-    if (ver.length()) {
-      if (package_satisfies(&other, name, op, ver))
-        return true;
-    } else {
-#else
-      string &name(conf);
-#endif
-      if (other.name_ == name)
-        return true;
-      for (auto &prov : other.provides_) {
-#ifdef PKGDEPDB_WITH_ALPM
-        string provname;
-        split_depstring(prov, provname, op, ver);
-#else
-        string &provname(prov);
-#endif
-        if (provname == name)
-          return true;
-      }
-#ifdef PKGDEPDB_WITH_ALPM
-    }
-#endif
+bool Package::ConflictsWith(const Package     &other,
+                            const VercmpCache &vercmp) const
+{
+  return names_package(conflicts_, other, vercmp);
+}
+
+bool Package::Replaces(const Package &other, const VercmpCache &vercmp) const {
+  return names_package(replaces_, other, vercmp);
+}
+
+Dependency::Dependency(const string &full, StringPool &strings)
+  : full_(strings.Get(full))
+  , op_(ANY)
+{
+  size_t opidx = full.find_first_of("=<>!");
+  if (opidx == string::npos) {
+    name_ = full_;
+    return;
   }
-  return false;
+  name_ = strings.Get(full.substr(0, opidx));
+
+  char op = full[opidx++];
+  bool eq = opidx < full.length() && full[opidx] == '=';
+  if (eq)
+    ++opidx;
+  switch (op) {
+    case '=': op_ = eq ? BAD : EQ; break;
+    case '!': op_ = eq ? NE  : BAD; break;
+    case '<': op_ = eq ? LE  : LT; break;
+    case '>': op_ = eq ? GE  : GT; break;
+  }
+  if (opidx < full.length())
+    version_ = strings.Get(full.substr(opidx));
 }
 
 } // ::pkgdepdb
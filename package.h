@@ -3,19 +3,40 @@
 
 namespace pkgdepdb {
 
+// A depends, provides, conflicts or replaces entry such as "foo>=1.0",
+// split into its parts when it is loaded. It reads like the full string.
+struct Dependency {
+  enum Op : uint8_t {
+    ANY,                  // no version given
+    EQ, NE, LT, LE, GT, GE,
+    BAD                   // an operator no version satisfies
+  };
+
+  istring full_;
+  istring name_;
+  istring version_;
+  Op      op_;
+
+  Dependency() : op_(ANY) {}
+  Dependency(const string &full, StringPool&);
+
+  operator const string&() const { return full_; }
+  const char* c_str() const { return full_.c_str(); }
+};
+
 struct Package {
-  string                  name_;
-  string                  version_;
+  istring                 name_;
+  istring                 version_;
   vec<rptr<Elf>>          objects_;
 
   // DB version 3:
-  StringList              depends_;
-  StringList              optdepends_;
-  StringList              provides_;
-  StringList              conflicts_;
-  StringList              replaces_;
+  DependList              depends_;
+  DependList              optdepends_;
+  DependList              provides_;
+  DependList              conflicts_;
+  DependList              replaces_;
   // DB version 5:
-  StringSet               groups_;
+  IStringSet              groups_;
   // DB version 6:
   // the filelist includes object files in v6 - makes things easier
   StringList              filelist_;
@@ -23,18 +44,19 @@ struct Package {
 // non-serialized {
   // used only while loading an archive
   struct {
+    string                   path;
     std::map<string, string> symlinks;
   } load_;
 // }
 
 
-  static Package* Open(const string& path, const Config&);
+  static Package* Open(const string& path, StringPool&, const Config&);
   Elf* Find(const string &dirname, const string &basename) const;
 
   // loading utiltiy functions
-  void Guess(const string& name);
-  bool ConflictsWith(const Package&) const;
-  bool Replaces(const Package&) const;
+  void Guess(const string& name, StringPool&);
+  bool ConflictsWith(const Package&, const VercmpCache&) const;
+  bool Replaces(const Package&, const VercmpCache&) const;
 
   // Output function:
   void ShowNeeded();
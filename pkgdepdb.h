@@ -22,6 +22,9 @@ struct Config {
   uint   json_             = 0;
   uint   max_jobs_         = 0;
   uint   log_level_        = LogLevel::Message;
+  bool   trace_links_      = false;
+  // 0 uses the default level of the compression format
+  uint   compression_level_ = 0;
 
   Config();
   Config(Config&&) = delete;
@@ -29,13 +32,25 @@ struct Config {
   ~Config();
 
   bool ReadConfig();
-  void Log(uint level, const char *msg, ...) const;
+
+  // The level check happens at the call site, so disabled messages cost a
+  // comparison. Without PKGDEPDB_DEBUG_LOG debug messages are compiled out.
+  template<typename... Args>
+  inline void Log(uint level, const char *msg, Args... args) const {
+#ifndef PKGDEPDB_DEBUG_LOG
+    if (level == Debug)
+      return;
+#endif
+    if (level >= log_level_)
+      Log_do(level, msg, args...);
+  }
 
   static const char *ParseJSONBit(const char *bit, uint &opt_json);
   static bool str2bool(const string&);
 
  private:
   bool ReadConfig(std::istream&, const char *path);
+  void Log_do(uint level, const char *msg, ...) const;
 };
 
 } // ::pkgdepdb
@@ -0,0 +1,138 @@
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "main.h"
+#include "pkgdepdb.h"
+#include "threads.h"
+
+#ifdef PKGDEPDB_ENABLE_THREADS
+namespace pkgdepdb {
+namespace thread {
+
+static unsigned int ncpus_init() {
+  long v = sysconf(_SC_NPROCESSORS_CONF);
+  return (v <= 0 ? 1 : (unsigned int)v);
+}
+
+unsigned int ncpus = ncpus_init();
+
+unsigned long threadcount(const Config &config) {
+  unsigned long count = ncpus;
+  if (config.max_jobs_ >= 1 && config.max_jobs_ < count)
+    count = config.max_jobs_;
+  return count;
+}
+
+Pool& pool(const Config &config) {
+  static Pool instance(threadcount(config));
+  return instance;
+}
+
+Pool::Pool(unsigned long count) {
+  threads_.reserve(count);
+  for (unsigned long i = 0; i != count; ++i)
+    threads_.emplace_back(&Pool::Loop, this, i);
+}
+
+Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  start_.notify_all();
+  for (auto &t : threads_)
+    t.join();
+}
+
+void Pool::Loop(unsigned long id) {
+  unsigned long seen = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    start_.wait(lock, [&]() {
+      return quit_ || (generation_ != seen && id < active_);
+    });
+    if (quit_)
+      return;
+    seen = generation_;
+
+    lock.unlock();
+    job_(id);
+    lock.lock();
+
+    if (!--running_)
+      done_.notify_all();
+  }
+}
+
+void Pool::Run(unsigned long           count,
+               function<job_func_t>    job,
+               function<status_func_t> status)
+{
+  if (count > threads_.size())
+    count = threads_.size();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_     = move(job);
+  active_  = count;
+  running_ = count;
+  ++generation_;
+  start_.notify_all();
+
+  while (running_) {
+    if (!status) {
+      done_.wait(lock);
+      continue;
+    }
+    if (done_.wait_for(lock, std::chrono::milliseconds(100)) ==
+        std::cv_status::timeout)
+    {
+      lock.unlock();
+      status();
+      lock.lock();
+    }
+  }
+  job_ = nullptr;
+}
+
+vec<Chunk> make_chunks(unsigned long                   count,
+                       unsigned long                   threadcount,
+                       const function<size_t(size_t)> &weight)
+{
+  static const size_t chunks_per_thread = 8;
+
+  vec<size_t> weights(count);
+  size_t total = 0;
+  for (size_t i = 0; i != count; ++i) {
+    weights[i] = 1 + (weight ? weight(i) : 0);
+    total += weights[i];
+  }
+
+  size_t target = total / (threadcount * chunks_per_thread);
+  if (!target)
+    target = 1;
+
+  vec<Chunk> chunks;
+  Chunk chunk { 0, 0, 0 };
+  for (size_t i = 0; i != count; ++i) {
+    chunk.weight += weights[i];
+    if (chunk.weight >= target) {
+      chunk.to = i+1;
+      chunks.push_back(chunk);
+      chunk = { i+1, i+1, 0 };
+    }
+  }
+  if (chunk.from != count) {
+    chunk.to = count;
+    chunks.push_back(chunk);
+  }
+
+  // the heaviest chunks go first so the tail end stays short
+  std::stable_sort(chunks.begin(), chunks.end(),
+    [](const Chunk &a, const Chunk &b) { return a.weight > b.weight; });
+  return chunks;
+}
+
+} // ::pkgdepdb::thread
+} // ::pkgdepdb
+#endif
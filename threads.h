@@ -0,0 +1,124 @@
+#ifndef PKGDEPDB_THREADS_H__
+#define PKGDEPDB_THREADS_H__
+
+#ifdef PKGDEPDB_ENABLE_THREADS
+namespace pkgdepdb {
+namespace thread {
+
+extern unsigned int ncpus;
+
+// Worker threads are started once and reused by every parallel phase.
+// Run() is not reentrant: jobs must not call Run() themselves.
+class Pool {
+ public:
+  using job_func_t    = void(unsigned long id);
+  using status_func_t = void();
+
+  explicit Pool(unsigned long count);
+  ~Pool();
+
+  unsigned long Size() const { return threads_.size(); }
+
+  // Runs job(0) ... job(count-1) on the workers and returns when all of
+  // them are done. While waiting, status is called about 10 times a second.
+  void Run(unsigned long                  count,
+           function<job_func_t>           job,
+           function<status_func_t>        status = nullptr);
+
+ private:
+  void Loop(unsigned long id);
+
+  vec<std::thread>        threads_;
+  std::mutex              mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  function<job_func_t>    job_;
+  unsigned long           active_     = 0;
+  unsigned long           running_    = 0;
+  unsigned long           generation_ = 0;
+  bool                    quit_       = false;
+};
+
+// the process-wide pool, sized from the job count of the first config
+Pool& pool(const Config&);
+
+// the number of threads a phase should use
+unsigned long threadcount(const Config&);
+
+using status_printer_func_t =
+  void (unsigned long at, unsigned long count, unsigned long threads);
+
+template<typename PerThread>
+using worker_func_t =
+  void(std::atomic_ulong*, size_t from, size_t to, PerThread&);
+
+template<typename PerThread>
+using merger_func_t = void(vec<PerThread>&&);
+
+// work is handed out in chunks of roughly equal weight, several per
+// thread, so a few huge packages cannot keep one thread busy alone
+struct Chunk {
+  size_t from, to;
+  size_t weight;
+};
+
+vec<Chunk> make_chunks(unsigned long                   count,
+                       unsigned long                   threadcount,
+                       const function<size_t(size_t)> &weight);
+
+template<typename PerThread>
+void work(unsigned long                      Count,
+          function<status_printer_func_t>    StatusPrinter,
+          function<worker_func_t<PerThread>> Worker,
+          function<merger_func_t<PerThread>> Merger,
+          const Config&                      Config,
+          function<size_t(size_t)>           Weight = nullptr)
+{
+  unsigned long threadcount = thread::threadcount(Config);
+  if (Count < threadcount)
+    threadcount = Count ? Count : 1;
+
+  if (!Config.quiet_)
+    StatusPrinter(0, Count, threadcount);
+
+  // data created by threads, to be merged in the merger
+  vec<PerThread> Data;
+  Data.resize(threadcount);
+
+  if (threadcount == 1) {
+    for (unsigned long i = 0; i != Count; ++i) {
+      Worker(nullptr, i, i+1, Data[0]);
+      if (!Config.quiet_)
+        StatusPrinter(i, Count, 1);
+    }
+    Merger(move(Data));
+    return;
+  }
+
+  vec<Chunk> chunks(make_chunks(Count, threadcount, Weight));
+  std::atomic_size_t cursor(0);
+  std::atomic_ulong  counter(0);
+
+  auto job = [&](unsigned long id) {
+    size_t c;
+    while ((c = cursor++) < chunks.size())
+      Worker(&counter, chunks[c].from, chunks[c].to, Data[id]);
+  };
+  function<Pool::status_func_t> status;
+  if (!Config.quiet_) {
+    status = [&]() {
+      StatusPrinter(counter.load(), Count, threadcount);
+    };
+  }
+  pool(Config).Run(threadcount, job, status);
+
+  Merger(move(Data));
+  if (!Config.quiet_)
+    StatusPrinter(Count, Count, threadcount);
+}
+
+} // ::pkgdepdb::thread
+} // ::pkgdepdb
+#endif
+
+#endif
@@ -30,6 +30,103 @@ bool strref::operator> (const std::string &s) const { return s_ >  s; }
 const std::string& strref::operator*() const { return s_; }
 const std::string* strref::operator->() const { return &s_; }
 
+// a string owned by a StringPool: equal strings from the same pool share
+// their storage, so equality is a pointer comparison
+class istring {
+public:
+  const std::string *s_;
+  istring() : s_(&strref::empty) {}
+  explicit istring(const std::string *s) : s_(s) {}
+  operator const std::string&() const { return *s_; }
+  const std::string& str()    const { return *s_; }
+  const char*        c_str()  const { return s_->c_str(); }
+  size_t             length() const { return s_->length(); }
+  size_t             size()   const { return s_->size(); }
+  bool               empty()  const { return s_->empty(); }
+  char operator[](size_t i) const { return (*s_)[i]; }
+  const std::string* operator->() const { return s_; }
+  bool operator==(const istring &o) const { return s_ == o.s_; }
+  bool operator!=(const istring &o) const { return s_ != o.s_; }
+  // ordering stays by content to keep sorted output stable
+  bool operator< (const istring &o) const {
+    return s_ != o.s_ && *s_ < *o.s_;
+  }
+};
+
+inline bool operator==(const istring &a, const std::string &b) {
+  return a.str() == b;
+}
+inline bool operator==(const std::string &a, const istring &b) {
+  return a == b.str();
+}
+inline bool operator!=(const istring &a, const std::string &b) {
+  return a.str() != b;
+}
+inline bool operator!=(const std::string &a, const istring &b) {
+  return a != b.str();
+}
+inline bool operator==(const istring &a, const char *b) {
+  return a.str() == b;
+}
+inline bool operator!=(const istring &a, const char *b) {
+  return a.str() != b;
+}
+inline std::string operator+(const istring &a, const std::string &b) {
+  return a.str() + b;
+}
+inline std::string operator+(const std::string &a, const istring &b) {
+  return a + b.str();
+}
+inline std::string operator+(const istring &a, const char *b) {
+  return a.str() + b;
+}
+inline std::string operator+(const char *a, const istring &b) {
+  return a + b.str();
+}
+
+class StringPool {
+public:
+  size_t refcount_ = 0;
+
+  istring Get(const std::string &s) {
+    if (s.empty())
+      return istring();
+#ifdef PKGDEPDB_ENABLE_THREADS
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+    return istring(&*strings_.insert(s).first);
+  }
+  istring Get(std::string &&s) {
+    if (s.empty())
+      return istring();
+#ifdef PKGDEPDB_ENABLE_THREADS
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+    return istring(&*strings_.insert(move(s)).first);
+  }
+  istring Get(const char *s) {
+    return Get(std::string(s));
+  }
+
+  // looks a string up without adding it, empty if it is unknown
+  istring Find(const std::string &s) const {
+#ifdef PKGDEPDB_ENABLE_THREADS
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+    auto iter = strings_.find(s);
+    return iter != strings_.end() ? istring(&*iter) : istring();
+  }
+
+  size_t size() const { return strings_.size(); }
+
+private:
+  // node based, so the strings never move
+  std::unordered_set<std::string> strings_;
+#ifdef PKGDEPDB_ENABLE_THREADS
+  mutable std::mutex              mutex_;
+#endif
+};
+
 template<typename T>
 class rptr {
 public:
@@ -145,4 +242,13 @@ inline bool all(const CONT &lst, const Args&... args) {
 
 } // ::pkgdepdb
 
+namespace std {
+template<>
+struct hash<pkgdepdb::istring> {
+  size_t operator()(const pkgdepdb::istring &s) const {
+    return hash<const void*>()(s.s_);
+  }
+};
+} // ::std
+
 #endif
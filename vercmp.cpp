@@ -0,0 +1,154 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "main.h"
+
+#ifdef PKGDEPDB_WITH_ALPM
+#  include <alpm.h>
+#endif
+
+#include "vercmp.h"
+
+namespace pkgdepdb {
+
+// same as pacman's parseEVR, without copying the string
+Version::Version(const char *str) {
+  const char *s = str;
+  while (*s && isdigit((unsigned char)*s))
+    ++s;
+  const char *end = s + strlen(s);
+  const char *se  = strrchr(s, '-');
+
+  static const char zero[] = "0";
+  if (*s == ':') {
+    epoch_     = str;
+    epoch_end_ = s;
+    if (epoch_ == epoch_end_) {
+      epoch_     = zero;
+      epoch_end_ = zero+1;
+    }
+    version_ = s+1;
+  } else {
+    epoch_     = zero;
+    epoch_end_ = zero+1;
+    version_   = str;
+  }
+  if (se) {
+    version_end_ = se;
+    release_     = se+1;
+    release_end_ = end;
+  } else {
+    version_end_ = end;
+    release_     = nullptr;
+    release_end_ = nullptr;
+  }
+}
+
+static inline bool isalnum_(char c) { return isalnum((unsigned char)c); }
+static inline bool isalpha_(char c) { return isalpha((unsigned char)c); }
+static inline bool isdigit_(char c) { return isdigit((unsigned char)c); }
+
+// rpmvercmp on [a, aend) and [b, bend): digit and letter segments are
+// compared in turn, a newer version has the longer number or, when one
+// runs out, the trailing number rather than letters
+static int rpmvercmp(const char *a, const char *aend,
+                     const char *b, const char *bend)
+{
+  if (aend-a == bend-b && !memcmp(a, b, size_t(aend-a)))
+    return 0;
+
+  const char *one = a, *ptr1 = a;
+  const char *two = b, *ptr2 = b;
+  while (one != aend && two != bend) {
+    while (one != aend && !isalnum_(*one)) ++one;
+    while (two != bend && !isalnum_(*two)) ++two;
+    if (one == aend || two == bend)
+      break;
+
+    // if the separator lengths differ we are done
+    if (one - ptr1 != two - ptr2)
+      return (one - ptr1) < (two - ptr2) ? -1 : 1;
+
+    ptr1 = one;
+    ptr2 = two;
+    bool isnum = isdigit_(*ptr1);
+    if (isnum) {
+      while (ptr1 != aend && isdigit_(*ptr1)) ++ptr1;
+      while (ptr2 != bend && isdigit_(*ptr2)) ++ptr2;
+    } else {
+      while (ptr1 != aend && isalpha_(*ptr1)) ++ptr1;
+      while (ptr2 != bend && isalpha_(*ptr2)) ++ptr2;
+    }
+
+    // numbers are newer than letters
+    if (two == ptr2)
+      return isnum ? 1 : -1;
+
+    if (isnum) {
+      while (one != ptr1 && *one == '0') ++one;
+      while (two != ptr2 && *two == '0') ++two;
+      if (ptr1 - one != ptr2 - two)
+        return (ptr1 - one) > (ptr2 - two) ? 1 : -1;
+    }
+
+    size_t len1 = size_t(ptr1 - one), len2 = size_t(ptr2 - two);
+    int rc = memcmp(one, two, len1 < len2 ? len1 : len2);
+    if (!rc && len1 != len2)
+      rc = len1 < len2 ? -1 : 1;
+    if (rc)
+      return rc < 0 ? -1 : 1;
+
+    one = ptr1;
+    two = ptr2;
+  }
+
+  if (one == aend && two == bend)
+    return 0;
+  // a remaining letter segment never beats an empty string
+  char c1 = one != aend ? *one : 0;
+  char c2 = two != bend ? *two : 0;
+  if ((!c1 && !isalpha_(c2)) || isalpha_(c1))
+    return -1;
+  return 1;
+}
+
+int vercmp(const Version &a, const Version &b) {
+  int ret = rpmvercmp(a.epoch_, a.epoch_end_, b.epoch_, b.epoch_end_);
+  if (ret)
+    return ret;
+  ret = rpmvercmp(a.version_, a.version_end_, b.version_, b.version_end_);
+  if (!ret && a.release_ && b.release_)
+    ret = rpmvercmp(a.release_, a.release_end_, b.release_, b.release_end_);
+  return ret;
+}
+
+int vercmp(const char *a, const char *b) {
+  if (!strcmp(a, b))
+    return 0;
+  return vercmp(Version(a), Version(b));
+}
+
+int VercmpCache::operator()(istring a, istring b) const {
+  if (a == b)
+    return 0;
+  Key key(&a.str(), &b.str());
+#ifdef PKGDEPDB_ENABLE_THREADS
+  Shard &shard = shards_[KeyHash()(key) % shard_count];
+  std::lock_guard<std::mutex> lock(shard.mutex_);
+  Map &results = shard.results_;
+#else
+  Map &results = results_;
+#endif
+  auto found = results.find(key);
+  if (found != results.end())
+    return found->second;
+#ifdef PKGDEPDB_WITH_ALPM
+  int ret = alpm_pkg_vercmp(a.c_str(), b.c_str());
+#else
+  int ret = vercmp(a.c_str(), b.c_str());
+#endif
+  results.emplace(key, ret);
+  return ret;
+}
+
+} // ::pkgdepdb
@@ -0,0 +1,51 @@
+#ifndef PKGDEPDB_VERCMP_H__
+#define PKGDEPDB_VERCMP_H__
+
+namespace pkgdepdb {
+
+// A version split the way pacman splits it: [epoch:]version[-release]
+// The parts point into the string, which has to outlive the Version.
+struct Version {
+  explicit Version(const char *str);
+
+  const char *epoch_,   *epoch_end_;
+  const char *version_, *version_end_;
+  // null when there is no release
+  const char *release_, *release_end_;
+};
+
+// compares like pacman's vercmp: <0, 0 or >0
+int vercmp(const Version &a, const Version &b);
+int vercmp(const char *a, const char *b);
+
+// Remembers the results for pairs of pooled strings, so the strings must
+// stay in their pool while the cache is in use.
+class VercmpCache {
+ public:
+  int operator()(istring a, istring b) const;
+
+ private:
+  using Key = std::pair<const string*, const string*>;
+  struct KeyHash {
+    // pooled strings are aligned, the low bits carry no information
+    size_t operator()(const Key &k) const {
+      return (uintptr_t(k.first) >> 4) * 31 + (uintptr_t(k.second) >> 4);
+    }
+  };
+  using Map = std::unordered_map<Key, int, KeyHash>;
+
+#ifdef PKGDEPDB_ENABLE_THREADS
+  static const size_t shard_count = 16;
+  struct Shard {
+    std::mutex mutex_;
+    Map        results_;
+  };
+  mutable Shard shards_[shard_count];
+#else
+  mutable Map   results_;
+#endif
+};
+
+} // ::pkgdepdb
+
+#endif